@@ -18,34 +18,74 @@
 */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "ed.h"
 
 
-static int current_addr_ = 0;	/* current address in editor buffer */
-static int last_addr_ = 0;	/* last address in editor buffer */
+static long current_addr_ = 0;	/* current address in editor buffer */
+static long last_addr_ = 0;	/* last address in editor buffer */
 static bool isbinary_ = false;	/* buffer contains ASCII NULs */
 static unsigned char modified_ = false;	/* 1=modified | 2=warned */
 
-static bool seek_write = false;	/* seek before writing */
-static FILE * sfp = 0;		/* scratch file pointer */
-static long sfpos = 0;		/* scratch file position */
-static line_node buffer_head;	/* editor buffer (linked list of line_node) */
-static line_node yank_buffer_head;
+static long sbuf_dead = 0;	/* estimated bytes of unreferenced text */
+static long compactions = 0, bytes_reclaimed = 0;
 
-
-int current_addr( void ) { return current_addr_; }
-int inc_current_addr( void )
+/* Hash table of the lines written with --dedup-lines. */
+typedef struct
+  {
+  uint32_t hash;		/* hash of text */
+  uint32_t len;			/* length of text; 0 if slot is empty */
+  long pos;			/* position of text in scratch buffer */
+  }
+Dedup_entry;
+static Dedup_entry * dedup_table = 0;
+static long dedup_slots = 0;		/* a power of 2 */
+static long dedup_used = 0;
+static long lines_shared = 0, bytes_shared = 0;
+
+/* Files read with map_sbuf_file. The lines of these files are not copied
+   to the scratch buffer. Instead, the nodes of the lines store in pos
+   -( position + 1 ), where position is that of the text in the
+   concatenation of all the mapped files. */
+typedef struct
+  {
+  const char * map;		/* mapping of the file, or 0 if copied */
+  long base;			/* position of the file in concatenation */
+  long size;
+  long spos;			/* position in scratch buffer if copied */
+  dev_t dev;			/* identity of the file */
+  ino_t ino;
+  }
+Mapped_file;
+static Mapped_file * mfiles = 0;
+static int mfiles_len = 0;
+static line_node buffer_head;	/* line 0 of the editor buffer */
+static line_node * buffer_root = 0;	/* tree of lines 1 to last_addr_ */
+static line_node * yank_root = 0;	/* tree of lines of the yank buffer */
+/* The lines deleted by the last command are the yank buffer, but belong
+   to the undo atom UDEL that restores them until the undo stack is
+   cleared, when the yank buffer takes them. 'u' gives the yank buffer a
+   copy of them before putting them back in the editor buffer. */
+static bool yank_shared = false;	/* yank_root belongs to ustack */
+
+
+long current_addr( void ) { return current_addr_; }
+long inc_current_addr( void )
   { if( ++current_addr_ > last_addr_ ) current_addr_ = last_addr_;
     return current_addr_; }
-void set_current_addr( const int addr ) { current_addr_ = addr; }
+void set_current_addr( const long addr ) { current_addr_ = addr; }
 
-int last_addr( void ) { return last_addr_; }
+long last_addr( void ) { return last_addr_; }
 
 bool isbinary( void ) { return isbinary_; }
 void set_binary( void ) { isbinary_ = true; }
@@ -55,68 +95,493 @@ void set_modified( const bool b ) { modified_ = b != 0; }  /* clear warned */
 bool warned( void ) { return modified_ == 3; }
 void set_warned( const bool b ) { if( b ) modified_ |= 2; else modified_ &= 1; }
 
-/* line 0 does not contain text, but it is part of the linked list of line_node.
-   Therefore inc_addr and dec_addr must cycle through addr 0. */
-int inc_addr( int addr )
+/* line 0 does not contain text, but it is the line before the first one and
+   after the last one. Therefore inc_addr and dec_addr must cycle through
+   addr 0. */
+long inc_addr( long addr )
   { if( ++addr > last_addr_ ) addr = 0; return addr; }
 
-int dec_addr( int addr )
+long dec_addr( long addr )
   { if( --addr < 0 ) addr = last_addr_; return addr; }
 
 
-/* link next and previous nodes */
-static void link_nodes( line_node * const prev, line_node * const next )
-  { prev->q_forw = next; next->q_back = prev; }
+/* The lines of the editor buffer are kept in a randomized binary search
+   tree ordered by address, where each node records the size of its
+   subtree. This allows to find the node of an address, and the address of
+   a node, in O(log n) time. Ranges of lines are spliced in and out of the
+   tree by split and merge, also in O(log n) time. Lines are traversed in
+   order through the parent links, in amortized constant time per line.
+   A range removed from the buffer remains a tree of its own, so that undo
+   can splice it back as a whole. buffer_head is not part of the tree. */
+
+static long node_size( const line_node * const lp )
+  { return lp ? lp->size_len & ( ( (uint64_t)1 << size_bits ) - 1 ) : 0; }
+
+static void set_node_size( line_node * const lp, const long size )
+  { lp->size_len = ( lp->size_len >> size_bits << size_bits ) | size; }
+
+static void update_node( line_node * const lp )
+  {
+  set_node_size( lp, node_size( lp->left ) + 1 + node_size( lp->right ) );
+  if( lp->left ) lp->left->parent = lp;
+  if( lp->right ) lp->right->parent = lp;
+  }
+
+
+/* return a pseudo-random number in the range [0, n) */
+static long random_below( const long n )
+  {
+  static uint64_t state = 88172645463325252ULL;
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state % (uint64_t)n;
+  }
+
+
+/* Concatenate the lines of trees a and b. Return the root of the result.
+   The root of the larger tree is chosen with higher probability, which
+   keeps the tree balanced on average. */
+static line_node * merge_trees( line_node * const a, line_node * const b )
+  {
+  if( !a ) return b;
+  if( !b ) return a;
+  if( random_below( node_size( a ) + node_size( b ) ) < node_size( a ) )
+    { a->right = merge_trees( a->right, b ); update_node( a );
+      a->parent = 0; return a; }
+  b->left = merge_trees( a, b->left ); update_node( b );
+  b->parent = 0; return b;
+  }
+
+
+/* Split tree t in the first n lines (*ap) and the rest (*bp). */
+static void split_tree( line_node * const t, const long n,
+                        line_node ** const ap, line_node ** const bp )
+  {
+  if( !t ) { *ap = *bp = 0; return; }
+  if( node_size( t->left ) >= n )
+    { split_tree( t->left, n, ap, &t->left ); update_node( t ); *bp = t; }
+  else
+    { split_tree( t->right, n - node_size( t->left ) - 1, &t->right, bp );
+      update_node( t ); *ap = t; }
+  t->parent = 0;
+  }
+
+
+/* return the first node of tree t, or 0 if t is empty */
+static line_node * first_node( line_node * t )
+  {
+  if( t ) while( t->left ) t = t->left;
+  return t;
+  }
+
+
+/* return the node following lp in its tree, or 0 if lp is the last one */
+static line_node * next_node( const line_node * lp )
+  {
+  if( lp->right ) return first_node( lp->right );
+  while( lp->parent && lp->parent->right == lp ) lp = lp->parent;
+  return lp->parent;
+  }
+
 
+static void prefetch_index( const line_node * const lp,
+                            const line_node * const np );
 
-/* insert line node into circular queue after previous */
-static void insert_node( line_node * const lp, line_node * const prev )
+/* Return the node following lp in the editor buffer. The line following
+   the last one is buffer_head, and the line following buffer_head is the
+   first one. */
+line_node * next_line_node( const line_node * const lp )
   {
-  link_nodes( lp, prev->q_forw );
-  link_nodes( prev, lp );
+  line_node * const np =
+    ( lp == &buffer_head ) ? first_node( buffer_root ) : next_node( lp );
+  if( !np ) return &buffer_head;
+  prefetch_index( lp, np );
+  return np;
   }
 
 
-/* to be called before add_line_node */
-static bool too_many_lines( void )
+/* free the nodes of tree t; unmark them first if unmark is true */
+static void free_line_node( line_node * const lp );
+static void free_tree( line_node * const t, const bool unmark )
   {
-  if( last_addr_ < INT_MAX - 2 ) return false;
-  set_error_msg( "Too many lines in buffer" ); return true;
+  if( !t ) return;
+  free_tree( t->left, unmark );
+  free_tree( t->right, unmark );
+  if( unmark ) { unmark_line_node( t ); unmark_unterminated_line( t ); }
+  free_line_node( t );
   }
 
-/* add a line node in the editor buffer after the given line */
-static void add_line_node( line_node * const lp )
+
+/* Return the root of the tree containing lp, and its rank in *rankp. */
+static line_node * node_root( const line_node * lp, long * const rankp )
+  {
+  long rank = node_size( lp->left ) + 1;
+
+  while( lp->parent )
+    {
+    if( lp->parent->right == lp ) rank += node_size( lp->parent->left ) + 1;
+    lp = lp->parent;
+    }
+  if( rankp ) *rankp = rank;
+  return (line_node *)lp;
+  }
+
+
+/* Return address of node in the editor buffer. If lp is buffer_head and
+   is_end is true, return the address following the last line in the tree,
+   which may differ from last_addr_ + 1 while undoing. */
+static long node_addr( const line_node * const lp, const bool is_end )
+  {
+  long addr;
+
+  if( lp == &buffer_head ) return is_end ? node_size( buffer_root ) + 1 : 0;
+  node_root( lp, &addr );
+  return addr;
+  }
+
+
+/* Build a balanced tree with the n nodes of the list starting at *lpp,
+   linked through their right links. Leave *lpp pointing to the node
+   following the last one used. */
+static line_node * build_tree( line_node ** const lpp, const long n )
+  {
+  if( n <= 0 ) return 0;
+  line_node * const left = build_tree( lpp, n / 2 );
+  line_node * const lp = *lpp;
+  *lpp = lp->right;
+  lp->left = left;
+  lp->right = build_tree( lpp, n - n / 2 - 1 );
+  update_node( lp ); lp->parent = 0;
+  return lp;
+  }
+
+
+/* insert the lines of tree t after line addr of the editor buffer */
+static void insert_tree( line_node * const t, const long addr )
+  {
+  line_node *a, *b;
+
+  split_tree( buffer_root, addr, &a, &b );
+  buffer_root = merge_trees( merge_trees( a, t ), b );
+  }
+
+
+/* remove lines from-to of the editor buffer and return them as a tree */
+static line_node * remove_tree( const long from, const long to )
+  {
+  line_node *a, *b, *c;
+
+  split_tree( buffer_root, to, &b, &c );
+  split_tree( b, from - 1, &a, &b );
+  buffer_root = merge_trees( a, c );
+  return b;
+  }
+
+
+/* Insert tree t of n new nodes, of which lp is the last one, in the editor
+   buffer after the current line. Make *upp the undo atom of the new lines,
+   or extend it with them if *upp != 0. Return false if error. */
+static bool insert_new_tree( line_node * const t, line_node * const lp,
+                             const long n, undo_atom ** const upp )
+  {
+  insert_tree( t, current_addr_ );
+  last_addr_ += n;
+  if( *upp ) { current_addr_ += n; (*upp)->tail = lp; }
+  else
+    {
+    const long addr = current_addr_ + 1;
+    current_addr_ += n;
+    *upp = push_undo_atom( UADD, addr, current_addr_ );
+    if( !*upp ) return false;
+    }
+  return true;
+  }
+
+
+/* Line nodes are allocated from slabs of slab_size bytes aligned to their
+   size, so that the slab of a node is found by masking its address. Each
+   slab keeps a list of its freed nodes, and is released as soon as all its
+   nodes are freed. One empty slab is kept as spare to avoid allocating and
+   releasing a slab repeatedly. */
+enum { slab_size = 1 << 18 };
+typedef struct Node_slab
+  {
+  struct Node_slab * prev;	/* list of slabs with free nodes, or */
+  struct Node_slab * next;	/* list of slabs of a part being indexed */
+  line_node * free_list;	/* freed nodes of this slab */
+  int bump;			/* nodes never allocated start here */
+  int used;			/* nodes in use */
+  bool avail;			/* slab is in the avail_slabs list */
+  line_node nodes[];
+  }
+Node_slab;
+enum { slab_nodes = ( slab_size - sizeof (Node_slab) ) / sizeof (line_node) };
+
+static Node_slab * avail_slabs = 0;	/* slabs with free nodes */
+static Node_slab * spare_slab = 0;
+static long slabs_in_use = 0, slabs_peak = 0;
+static long nodes_in_use = 0, nodes_peak = 0;
+static long nodes_allocated = 0, nodes_freed = 0;
+
+static Node_slab * slab_of( const line_node * const lp )
+  { return (Node_slab *)( (uintptr_t)lp & ~(uintptr_t)( slab_size - 1 ) ); }
+
+
+/* With --index-file, the slabs are carved from extents of a temporary file
+   mapped in memory instead of being allocated from the heap. The kernel
+   then keeps in memory only the pages of the index recently used, and
+   writes the others back to the file when memory is needed, as with any
+   other file. The nodes don't move, so the pointers to them stay valid.
+   Freed slabs are kept for reuse. A traversal of the buffer that goes on
+   to the next slab in memory asks the kernel to read ahead the slabs
+   that follow. */
+enum { min_extent_slabs = 16, max_extent_slabs = 1024, prefetch_slabs = 4 };
+static pthread_mutex_t index_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int index_fd = -1;
+static long index_file_size = 0;
+static int index_extents = 0;
+static char * extent_next = 0;		/* unused slabs of the last extent */
+static char * extent_end = 0;
+static Node_slab * free_index_slabs = 0;
+static long index_prefetches = 0;
+
+/* Map a new extent of the index file at an address aligned to slab_size.
+   The extents double in size up to max_extent_slabs slabs. */
+static bool map_index_extent( void )
+  {
+  const long size = (long)slab_size *
+    min( max_extent_slabs, min_extent_slabs << min( index_extents, 6 ) );
+
+  if( index_fd < 0 && ( index_fd = create_temp_file() ) < 0 ) return false;
+  /* allocate the blocks now to get ENOSPC instead of SIGBUS later */
+  const int err = posix_fallocate( index_fd, index_file_size, size );
+  if( err == EINVAL || err == EOPNOTSUPP )	/* not supported by the fs */
+    { if( ftruncate( index_fd, index_file_size + size ) != 0 ) return false; }
+  else if( err ) { errno = err; return false; }
+  /* reserve the addresses, then map the file over the aligned part */
+  char * const r = (char *)mmap( 0, size + slab_size, PROT_NONE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+  if( r == MAP_FAILED ) return false;
+  char * const a = (char *)
+    ( ( (uintptr_t)r + slab_size - 1 ) & ~(uintptr_t)( slab_size - 1 ) );
+  if( a > r ) munmap( r, a - r );
+  munmap( a + size, r + slab_size - a );
+  if( mmap( a, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+            index_fd, index_file_size ) == MAP_FAILED )
+    { munmap( a, size ); return false; }
+  index_file_size += size; ++index_extents;
+  extent_next = a; extent_end = a + size;
+  return true;
+  }
+
+
+/* If the traversal from lp to np goes on to the next slab in the index
+   file, ask the kernel to read the slabs following the slab of np.
+   May run in a worker thread. */
+static void prefetch_index( const line_node * const lp,
+                            const line_node * const np )
+  {
+  if( index_fd < 0 ) return;
+  char * const p = (char *)slab_of( np );
+  if( p != (char *)slab_of( lp ) + slab_size ) return;
+  posix_madvise( p + slab_size, (long)prefetch_slabs * slab_size,
+                 POSIX_MADV_WILLNEED );
+  pthread_mutex_lock( &index_mutex );
+  ++index_prefetches;
+  pthread_mutex_unlock( &index_mutex );
+  }
+
+
+/* allocate an empty slab. May run in a worker thread */
+static Node_slab * new_slab( void )
+  {
+  void * p = 0;
+  if( !index_file() )
+    { if( posix_memalign( &p, slab_size, slab_size ) != 0 ) return 0; }
+  else
+    {
+    pthread_mutex_lock( &index_mutex );
+    if( free_index_slabs )
+      { p = free_index_slabs; free_index_slabs = free_index_slabs->next; }
+    else if( extent_next < extent_end || map_index_extent() )
+      { p = extent_next; extent_next += slab_size; }
+    pthread_mutex_unlock( &index_mutex );
+    if( !p ) return 0;
+    }
+  Node_slab * const sp = (Node_slab *)p;
+  sp->prev = sp->next = 0; sp->free_list = 0;
+  sp->bump = sp->used = 0; sp->avail = false;
+  return sp;
+  }
+
+
+/* release an empty slab */
+static void release_slab( Node_slab * const sp )
+  {
+  if( !index_file() ) { free( sp ); return; }
+  pthread_mutex_lock( &index_mutex );
+  sp->next = free_index_slabs; free_index_slabs = sp;
+  pthread_mutex_unlock( &index_mutex );
+  }
+
+
+static void link_avail_slab( Node_slab * const sp )
   {
-  line_node * const prev = search_line_node( current_addr_ );
-  insert_node( lp, prev );
-  ++current_addr_;
-  ++last_addr_;
+  sp->prev = 0; sp->next = avail_slabs;
+  if( avail_slabs ) avail_slabs->prev = sp;
+  avail_slabs = sp; sp->avail = true;
+  }
+
+
+static void unlink_avail_slab( Node_slab * const sp )
+  {
+  if( sp->prev ) sp->prev->next = sp->next; else avail_slabs = sp->next;
+  if( sp->next ) sp->next->prev = sp->prev;
+  sp->prev = sp->next = 0; sp->avail = false;
+  }
+
+
+/* count a slab, whose 'used' nodes are already allocated, in the pool */
+static void add_slab( Node_slab * const sp )
+  {
+  if( ++slabs_in_use > slabs_peak ) slabs_peak = slabs_in_use;
+  nodes_allocated += sp->used;
+  if( ( nodes_in_use += sp->used ) > nodes_peak ) nodes_peak = nodes_in_use;
+  if( sp->used < slab_nodes ) link_avail_slab( sp );
+  }
+
+
+static line_node * alloc_line_node( void )
+  {
+  Node_slab * sp = avail_slabs;
+  line_node * lp;
+
+  if( !sp )
+    {
+    if( spare_slab ) { sp = spare_slab; spare_slab = 0; }
+    else if( !( sp = new_slab() ) ) return 0;
+    add_slab( sp );
+    }
+  if( sp->free_list ) { lp = sp->free_list; sp->free_list = lp->left; }
+  else lp = &sp->nodes[sp->bump++];
+  if( ++sp->used >= slab_nodes ) unlink_avail_slab( sp );
+  lp->size_len = 1;	/* write before set_node_text reads it, so that a new
+			   page is not mapped first read-only and then copied */
+  ++nodes_allocated;
+  if( ++nodes_in_use > nodes_peak ) nodes_peak = nodes_in_use;
+  return lp;
+  }
+
+
+static void free_line_node( line_node * const lp )
+  {
+  Node_slab * const sp = slab_of( lp );
+
+  if( node_pos( lp ) >= 0 ) sbuf_dead += node_len( lp );
+  lp->left = sp->free_list; sp->free_list = lp;
+  --nodes_in_use; ++nodes_freed;
+  if( --sp->used > 0 ) { if( !sp->avail ) link_avail_slab( sp ); return; }
+  if( sp->avail ) unlink_avail_slab( sp );
+  --slabs_in_use;
+  if( spare_slab ) release_slab( sp );
+  else { sp->free_list = 0; sp->bump = 0; spare_slab = sp; }
+  }
+
+
+void print_buffer_stats( void )
+  {
+  fprintf( stderr, "line nodes: %ld in use (peak %ld), %ld allocated, "
+           "%ld freed\n", nodes_in_use, nodes_peak, nodes_allocated,
+           nodes_freed );
+  fprintf( stderr, "node slabs: %ld in use (peak %ld) of %d nodes, "
+           "%ld bytes\n", slabs_in_use, slabs_peak, (int)slab_nodes,
+           ( slabs_in_use + ( spare_slab != 0 ) ) * slab_size );
+  fprintf( stderr, "scratch buffer: %ld bytes, %ld compactions reclaimed "
+           "%ld bytes\n", scratch_size(), compactions, bytes_reclaimed );
+  if( index_fd >= 0 )
+    fprintf( stderr, "index file: %ld bytes in %d extents, %ld prefetches\n",
+             index_file_size, index_extents, index_prefetches );
+  print_scratch_stats();
+  if( dedup_lines() )
+    fprintf( stderr, "shared lines: %ld lines, %ld bytes not written, "
+             "%ld distinct lines indexed\n", lines_shared, bytes_shared,
+             dedup_used );
   }
 
 
 /* return a pointer to a copy of a line node, or to a new node if lp == 0 */
 static line_node * dup_line_node( line_node * const lp )
   {
-  line_node * const p = (line_node *) malloc( sizeof (line_node) );
+  line_node * const p = alloc_line_node();
   if( !p )
     {
     show_strerror( 0, errno );
     set_error_msg( mem_msg );
     return 0;
     }
-  if( lp ) { p->pos = lp->pos; p->len = lp->len; }
+  if( lp ) set_node_text( p, node_pos( lp ), node_len( lp ) );
   return p;
   }
 
 
+/* Return a tree of copies of the n > 0 lines starting at lp, which are in
+   the same tree, and set *lastp to the last copy. Return 0 if error. */
+static line_node * dup_lines( line_node * lp, const long n,
+                              line_node ** const lastp )
+  {
+  line_node chain;			/* list of the copies */
+  line_node * cp = &chain;
+  long i;
+
+  for( i = 0; i < n; ++i, lp = next_node( lp ) )
+    {
+    line_node * const p = dup_line_node( lp );
+    if( !p ) break;
+    cp->right = p; cp = p;
+    }
+  if( i < n )
+    {
+    for( cp = chain.right; i > 0; --i )
+      { line_node * const np = cp->right; free_line_node( cp ); cp = np; }
+    return 0;
+    }
+  line_node * first = chain.right;
+  *lastp = cp;
+  return build_tree( &first, n );
+  }
+
+
+/* Insert copies of the n lines starting at lp, which are in the same
+   tree, after line addr. The copies are made first and inserted as a
+   whole, so the lines copied may include line addr.
+   Return false if error. */
+static bool insert_copies( line_node * const lp, const long n,
+                           const long addr )
+  {
+  undo_atom * up = 0;
+  line_node * last;
+
+  current_addr_ = addr;
+  if( last_addr_ + n > max_lines )
+    { set_error_msg( "Too many lines in buffer" ); return false; }
+  disable_interrupts();
+  line_node * const t = dup_lines( lp, n, &last );
+  if( t ) modified_ = true;
+  const bool ok = t && insert_new_tree( t, last, n, &up );
+  enable_interrupts();
+  return ok;
+  }
+
+
 /* Insert text from stdin (or from command buffer if global) to after
    line n; stop when either a single period is read or at EOF.
    Return false if insertion fails.
 */
-bool append_lines( const char ** const ibufpp, const int addr,
+bool append_lines( const char ** const ibufpp, const long addr,
                    bool insert, const bool isglobal )
   {
-  int size = 0;
+  long size = 0;
   undo_atom * up = 0;
   current_addr_ = addr;
 
@@ -132,18 +597,16 @@ bool append_lines( const char ** const ibufpp, const int addr,
       {
       if( !**ibufpp ) return true;
       for( size = 0; (*ibufpp)[size++] != '\n'; ) ;
+      if( size != 2 || **ibufpp != '.' )	/* take all lines up to '.' */
+        while( (*ibufpp)[size] &&
+               ( (*ibufpp)[size] != '.' || (*ibufpp)[size+1] != '\n' ) )
+          while( (*ibufpp)[size++] != '\n' ) ;
       }
     if( size == 2 && **ibufpp == '.' ) { *ibufpp += size; return true; }
     disable_interrupts();
     if( insert ) { insert = false; if( current_addr_ > 0 ) --current_addr_; }
-    if( !put_sbuf_line( *ibufpp, size ) )
+    if( put_sbuf_lines( *ibufpp, size, &up ) < 0 )
       { enable_interrupts(); return false; }
-    if( up ) up->tail = search_line_node( current_addr_ );
-    else
-      {
-      up = push_undo_atom( UADD, current_addr_, current_addr_ );
-      if( !up ) { enable_interrupts(); return false; }
-      }
     *ibufpp += size;
     modified_ = true;
     enable_interrupts();
@@ -153,87 +616,133 @@ bool append_lines( const char ** const ibufpp, const int addr,
 
 static void clear_yank_buffer( void )
   {
-  line_node * lp = yank_buffer_head.q_forw;
-
   disable_interrupts();
-  while( lp != &yank_buffer_head )
-    {
-    line_node * const p = lp->q_forw;
-    link_nodes( lp->q_back, lp->q_forw );
-    free( lp );
-    lp = p;
-    }
+  if( !yank_shared ) free_tree( yank_root, true );
+  yank_root = 0; yank_shared = false;
   enable_interrupts();
   }
 
 
-/* close scratch file */
-bool close_sbuf( void )
+/* Append len bytes of text to the scratch buffer.
+   Return the position of the text in the scratch buffer, or -1 if error. */
+static long write_sbuf( const char * const buf, const long len )
   {
-  clear_yank_buffer();
-  clear_undo_stack();
-  if( sfp )
+  if( len > max_line_pos - scratch_size() )
+    { set_error_msg( "Scratch buffer too big" ); return -1; }
+  return append_scratch( buf, len );
+  }
+
+
+static void clear_dedup_table( const bool release );
+
+
+/* Map in memory the regular file open on descriptor fd, so that its lines
+   can be inserted with put_mapped_lines. Return the mapping and its size,
+   or 0 if the file can't be mapped. */
+const char * map_sbuf_file( const int fd, long * const sizep )
+  {
+  struct stat st;
+  const long base = mfiles_len ?
+    mfiles[mfiles_len-1].base + mfiles[mfiles_len-1].size : 0;
+
+  if( fstat( fd, &st ) != 0 || !S_ISREG( st.st_mode ) || st.st_size <= 0 ||
+      st.st_size >= max_line_pos - base ) return 0;
+  Mapped_file * const p = (Mapped_file *)
+    realloc( mfiles, ( mfiles_len + 1 ) * sizeof mfiles[0] );
+  if( !p ) return 0;
+  mfiles = p;
+  void * const map = mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  if( map == MAP_FAILED ) return 0;
+  Mapped_file * const mf = &mfiles[mfiles_len++];
+  mf->map = (const char *)map; mf->base = base; mf->size = st.st_size;
+  mf->spos = -1; mf->dev = st.st_dev; mf->ino = st.st_ino;
+  *sizep = mf->size;
+  return mf->map;
+  }
+
+
+/* Copy to the scratch buffer the text of the mapped files that are the same
+   file as filename, which is about to be written, and unmap them.
+   Return false if error. */
+bool unmap_sbuf_files( const char * const filename )
+  {
+  enum { block_size = 1 << 30 };
+  struct stat st;
+  int i;
+
+  if( !mfiles_len || stat( filename, &st ) != 0 ) return true;
+  for( i = 0; i < mfiles_len; ++i )
     {
-    if( fclose( sfp ) != 0 )
+    Mapped_file * const mf = &mfiles[i];
+    long pos;
+    if( !mf->map || mf->dev != st.st_dev || mf->ino != st.st_ino ) continue;
+    disable_interrupts();
+    for( pos = 0; pos < mf->size; pos += block_size )
       {
-      show_strerror( 0, errno );
-      set_error_msg( "Cannot close temp file" );
-      return false;
+      const long spos = write_sbuf( mf->map + pos,
+                                    min( mf->size - pos, (long)block_size ) );
+      if( spos < 0 ) { enable_interrupts(); return false; }
+      if( pos == 0 ) mf->spos = spos;
       }
-    sfp = 0;
+    munmap( (void *)mf->map, mf->size ); mf->map = 0;
+    enable_interrupts();
     }
-  sfpos = 0;
-  seek_write = false;
   return true;
   }
 
 
-/* copy a range of lines; return false if error */
-bool copy_lines( const int first_addr, const int second_addr, const int addr )
+static void free_mfiles( void )
   {
-  line_node * np = search_line_node( first_addr );
-  undo_atom * up = 0;
-  int n = second_addr - first_addr + 1;
-  int m = 0;
+  while( mfiles_len > 0 )
+    { const Mapped_file * const mf = &mfiles[--mfiles_len];
+      if( mf->map ) munmap( (void *)mf->map, mf->size ); }
+  free( mfiles ); mfiles = 0;
+  }
 
-  current_addr_ = addr;
-  if( addr >= first_addr && addr < second_addr )
+
+/* Return the mapped file containing position pos of the concatenation. */
+static const Mapped_file * find_mfile( const long pos )
+  {
+  int l = 0, r = mfiles_len - 1;
+  while( l < r )
     {
-    n = addr - first_addr + 1;
-    m = second_addr - addr;
+    const int m = ( l + r + 1 ) / 2;
+    if( mfiles[m].base <= pos ) l = m; else r = m - 1;
     }
-  for( ; n > 0; n = m, m = 0, np = search_line_node( current_addr_ + 1 ) )
-    for( ; n-- > 0; np = np->q_forw )
-      {
-      if( too_many_lines() ) return false;
-      disable_interrupts();
-      line_node * lp = dup_line_node( np );
-      if( !lp ) { enable_interrupts(); return false; }
-      add_line_node( lp );
-      if( up ) up->tail = lp;
-      else
-        {
-        up = push_undo_atom( UADD, current_addr_, current_addr_ );
-        if( !up ) { enable_interrupts(); return false; }
-        }
-      modified_ = true;
-      enable_interrupts();
-      }
-  return true;
+  return &mfiles[l];
+  }
+
+
+/* close scratch file */
+bool close_sbuf( void )
+  {
+  clear_yank_buffer();
+  clear_undo_stack();
+  if( mfiles ) free_mfiles();
+  clear_dedup_table( true );
+  return close_scratch();
+  }
+
+
+/* copy a range of lines; return false if error */
+bool copy_lines( const long first_addr, const long second_addr,
+                 const long addr )
+  {
+  return insert_copies( search_line_node( first_addr ),
+                        second_addr - first_addr + 1, addr );
   }
 
 
 /* delete a range of lines */
-bool delete_lines( const int from, const int to, const bool isglobal )
+bool delete_lines( const long from, const long to, const bool isglobal )
   {
-  if( !yank_lines( from, to ) ) return false;
   disable_interrupts();
+  clear_yank_buffer();
   if( !push_undo_atom( UDEL, from, to ) )
     { enable_interrupts(); return false; }
-  line_node * n = search_line_node( inc_addr( to ) );
-  line_node * p = search_line_node( from - 1 );	/* this search_line_node last! */
-  if( isglobal ) unset_active_nodes( p->q_forw, n );
-  link_nodes( p, n );
+  if( isglobal ) unset_active_nodes( search_line_node( from ),
+                                     search_line_node( inc_addr( to ) ) );
+  yank_root = remove_tree( from, to ); yank_shared = true;
   last_addr_ -= to - from + 1;
   current_addr_ = min( from, last_addr_ );
   modified_ = true;
@@ -243,13 +752,13 @@ bool delete_lines( const int from, const int to, const bool isglobal )
 
 
 /* return line number of pointer */
-int get_line_node_addr( const line_node * const lp )
+long get_line_node_addr( const line_node * const lp )
   {
-  const line_node * p = &buffer_head;
-  int addr = 0;
+  long addr = 0;
 
-  while( p != lp && ( p = p->q_forw ) != &buffer_head ) ++addr;
-  if( addr && p == &buffer_head ) { invalid_address(); return -1; }
+  if( lp == &buffer_head ) return 0;
+  if( !lp || node_root( lp, &addr ) != buffer_root )	/* not in buffer */
+    { if( last_addr_ ) { invalid_address(); return -1; } return 0; }
   return addr;
   }
 
@@ -258,36 +767,69 @@ int get_line_node_addr( const line_node * const lp )
 char * get_sbuf_line( const line_node * const lp )
   {
   static char * buf = 0;
-  static int bufsz = 0;
-  int len;
+  static long bufsz = 0;
+  long pos;
+  long len;
 
   if( lp == &buffer_head ) return 0;
-  seek_write = true;			/* force seek on write */
-  /* out of position */
-  if( sfpos != lp->pos )
+  pos = node_pos( lp ); len = node_len( lp );
+  if( pos < 0 )				/* line of a mapped file */
     {
-    sfpos = lp->pos;
-    if( fseek( sfp, sfpos, SEEK_SET ) != 0 )
+    const Mapped_file * const mf = find_mfile( -pos - 1 );
+    pos = -pos - 1 - mf->base;
+    if( !mf->map ) pos += mf->spos;	/* file copied to scratch buffer */
+    else
       {
-      show_strerror( 0, errno );
-      set_error_msg( "Cannot seek temp file" );
-      return 0;
+      if( !resize_buffer( &buf, &bufsz, len + 1 ) ) return 0;
+      memcpy( buf, mf->map + pos, len );
+      buf[len] = 0;
+      return buf;
       }
     }
-  len = lp->len;
-  if( !resize_buffer( &buf, &bufsz, len + 1 ) ) return 0;
-  if( (int)fread( buf, 1, len, sfp ) != len )
-    {
-    show_strerror( 0, errno );
-    set_error_msg( "Cannot read temp file" );
-    return 0;
-    }
-  sfpos += len;		/* update file position */
+  if( !resize_buffer( &buf, &bufsz, len + 1 ) ||
+      !read_scratch( buf, pos, len ) ) return 0;
   buf[len] = 0;
   return buf;
   }
 
 
+static const char * line_part( const line_node * const lp, const long off,
+                               long * const sizep, const bool shared )
+  {
+  long pos = node_pos( lp );
+  const long len = min( *sizep, node_len( lp ) - off );
+
+  if( len <= 0 ) { *sizep = 0; return ""; }
+  *sizep = len;
+  if( pos < 0 )				/* line of a mapped file */
+    {
+    const Mapped_file * const mf = find_mfile( -pos - 1 );
+    pos = -pos - 1 - mf->base + off;
+    if( mf->map ) return mf->map + pos;
+    pos += mf->spos;			/* file copied to scratch buffer */
+    }
+  else pos += off;
+  return shared ? view_scratch_shared( pos, sizep ) :
+                  get_scratch_part( pos, sizep );
+  }
+
+
+/* Return a pointer to the text of line lp from offset off, and set *sizep
+   to the size of the part returned, which is at most *sizep bytes and may
+   be less. This allows to process long lines in parts. See
+   get_scratch_part for the validity of the pointer. Return 0 if error. */
+const char * get_sbuf_line_part( const line_node * const lp, const long off,
+                                 long * const sizep )
+  { return line_part( lp, off, sizep, false ); }
+
+
+/* Like get_sbuf_line_part, but may be called from several threads at once
+   if scratch_shared(), as long as the buffer is not modified meanwhile. */
+const char * get_sbuf_line_shared( const line_node * const lp,
+                                   const long off, long * const sizep )
+  { return line_part( lp, off, sizep, true ); }
+
+
 /* open scratch buffer; initialize line queue */
 bool init_buffers( void )
   {
@@ -299,38 +841,41 @@ bool init_buffers( void )
      EOF */
   setvbuf( stdin, 0, _IONBF, 0 );
   if( !open_sbuf() ) return false;
-  link_nodes( &buffer_head, &buffer_head );
-  link_nodes( &yank_buffer_head, &yank_buffer_head );
+  buffer_root = 0;
+  yank_root = 0;
   return true;
   }
 
 
-/* replace a range of lines with the joined text of those lines */
-bool join_lines( const int from, const int to, const bool isglobal )
+/* Replace a range of lines with the joined text of those lines.
+   The text is copied part by part to the scratch buffer, so that joining
+   long lines does not need a buffer of the size of the joined line. */
+bool join_lines( const long from, const long to, const bool isglobal )
   {
-  static char * buf = 0;
-  static int bufsz = 0;
-  int size = 0;
   line_node * const ep = search_line_node( inc_addr( to ) );
   line_node * bp = search_line_node( from );
+  bool ok = true;
 
-  while( bp != ep )
+  disable_interrupts();
+  pin_sbuf( true );
+  for( ; ok && bp != ep; bp = next_line_node( bp ) )
     {
-    const char * const s = get_sbuf_line( bp );
-    if( !s || !resize_buffer( &buf, &bufsz, size + bp->len ) ) return false;
-    memcpy( buf + size, s, bp->len );
-    size += bp->len;
-    bp = bp->q_forw;
+    const long len = node_len( bp );
+    long off, size;
+    for( off = 0; ok && off < len; off += size )
+      {
+      size = len - off;
+      const char * const s = get_sbuf_line_part( bp, off, &size );
+      ok = s && put_sbuf_text( s, size );
+      }
     }
-  if( !resize_buffer( &buf, &bufsz, size + 2 ) ) return false;
-  buf[size++] = '\n';
-  buf[size++] = 0;
-  if( !delete_lines( from, to, isglobal ) ) return false;
+  ok = ok && put_sbuf_text( "\n", 1 );
+  pin_sbuf( false );
+  undo_atom * up = 0;
+  if( !ok || !delete_lines( from, to, isglobal ) )
+    { discard_sbuf_text(); enable_interrupts(); return false; }
   current_addr_ = from - 1;
-  disable_interrupts();
-  if( !put_sbuf_line( buf, size ) ||
-      !push_undo_atom( UADD, current_addr_, current_addr_ ) )
-    { enable_interrupts(); return false; }
+  if( insert_sbuf_text( &up ) < 0 ) { enable_interrupts(); return false; }
   modified_ = true;
   enable_interrupts();
   return true;
@@ -338,12 +883,12 @@ bool join_lines( const int from, const int to, const bool isglobal )
 
 
 /* move a range of lines */
-bool move_lines( const int first_addr, const int second_addr, const int addr,
-                 const bool isglobal )
+bool move_lines( const long first_addr, const long second_addr,
+                 const long addr, const bool isglobal )
   {
-  line_node *b1, *a1, *b2, *a2;
-  int n = inc_addr( second_addr );
-  int p = first_addr - 1;
+  line_node *b2, *a2;
+  const long n = inc_addr( second_addr );
+  const long p = first_addr - 1;
 
   disable_interrupts();
   if( addr == first_addr - 1 || addr == second_addr )
@@ -357,43 +902,27 @@ bool move_lines( const int first_addr, const int second_addr, const int addr,
     { enable_interrupts(); return false; }
   else
     {
-    a1 = search_line_node( n );
-    if( addr < first_addr )
-      {
-      b1 = search_line_node( p );
-      b2 = search_line_node( addr );	/* this search_line_node last! */
-      }
-    else
-      {
-      b2 = search_line_node( addr );
-      b1 = search_line_node( p );	/* this search_line_node last! */
-      }
-    a2 = b2->q_forw;
-    link_nodes( b2, b1->q_forw );
-    link_nodes( a1->q_back, a2 );
-    link_nodes( b1, a1 );
+    b2 = search_line_node( addr );
+    a2 = next_line_node( b2 );
+    line_node * const t = remove_tree( first_addr, second_addr );
+    insert_tree( t, ( addr < first_addr ) ? addr :
+                    addr - ( second_addr - first_addr + 1 ) );
     current_addr_ = addr + ( ( addr < first_addr ) ?
                            second_addr - first_addr + 1 : 0 );
     }
-  if( isglobal ) unset_active_nodes( b2->q_forw, a2 );
+  if( isglobal ) unset_active_nodes( next_line_node( b2 ), a2 );
   modified_ = true;
   enable_interrupts();
   return true;
   }
 
 
-/* open scratch file */
+/* Open scratch buffer in the storage selected with --scratch. */
 bool open_sbuf( void )
   {
   isbinary_ = false; reset_unterminated_line();
-  sfp = tmpfile();
-  if( !sfp )
-    {
-    show_strerror( 0, errno );
-    set_error_msg( "Cannot open temp file" );
-    return false;
-    }
-  return true;
+  sbuf_dead = 0;
+  return open_scratch();
   }
 
 
@@ -409,129 +938,432 @@ int path_max( const char * filename )
 
 
 /* append lines from the yank buffer */
-bool put_lines( const int addr )
+bool put_lines( const long addr )
   {
-  undo_atom * up = 0;
-  line_node * lp = yank_buffer_head.q_forw;
+  if( !yank_root ) { set_error_msg( "Nothing to put" ); return false; }
+  return insert_copies( first_node( yank_root ), node_size( yank_root ),
+                        addr );
+  }
 
-  if( lp == &yank_buffer_head )
-    { set_error_msg( "Nothing to put" ); return false; }
-  current_addr_ = addr;
-  while( lp != &yank_buffer_head )
+
+/* A part of a run of lines, indexed by index_part. */
+typedef struct
+  {
+  const char * buf;		/* text of the part */
+  long size;
+  long pos;			/* position of buf in scratch buffer or in
+				   the mapped files */
+  bool mapped;			/* buf is in a mapped file */
+  bool threaded;		/* part is indexed by a worker thread */
+  Node_slab * slabs;		/* private slabs of a threaded part */
+  bool has_nul;			/* buf contains NULs (only if mapped) */
+  bool too_long;		/* a line is longer than max_line_len */
+  long bytes;			/* size of the lines, including newlines */
+  line_node * last;		/* last new node */
+  line_node * root;		/* balanced tree of the new nodes */
+  long n;			/* number of new nodes, or -1 if error */
+  }
+Index_part;
+
+/* Allocate a node for a threaded part from its private slabs, which are
+   added to the pool by the main thread after indexing. */
+static line_node * alloc_part_node( Index_part * const ip )
+  {
+  Node_slab * sp = ip->slabs;
+  if( !sp || sp->bump >= slab_nodes )
     {
-    if( too_many_lines() ) return false;
-    disable_interrupts();
-    line_node * p = dup_line_node( lp );
-    if( !p ) { enable_interrupts(); return false; }
-    add_line_node( p );
-    if( up ) up->tail = p;
+    if( !( sp = new_slab() ) ) return 0;
+    sp->next = ip->slabs; ip->slabs = sp;
+    }
+  ++sp->used;
+  line_node * const lp = &sp->nodes[sp->bump++];
+  lp->size_len = 1;			/* see alloc_line_node */
+  return lp;
+  }
+
+
+static void free_index_parts( Index_part * const parts, const int nparts )
+  {
+  int i;
+  for( i = 0; i < nparts; ++i )
+    {
+    Index_part * const ip = &parts[i];
+    if( ip->threaded )			/* release the slabs in bulk */
+      while( ip->slabs )
+        { Node_slab * const sp = ip->slabs; ip->slabs = sp->next;
+          release_slab( sp ); }
+    else free_tree( ip->root, false );
+    }
+  }
+
+
+/* Create a node for each line of a part and build their tree.
+   The text of a mapped file can't be modified, so the CRs to be stripped
+   from its lines are just left out of the line lengths.
+   May run in a worker thread, so it must not report errors. */
+static void * index_part( void * const arg )
+  {
+  Index_part * const ip = (Index_part *)arg;
+  line_node chain;
+  line_node * lp = &chain;
+  const char * p = ip->buf;
+  const char * const end = ip->buf + ip->size;
+  const bool strip = ip->mapped && strip_cr();
+  long n = 0;
+
+  ip->has_nul = ip->mapped && memchr( ip->buf, 0, ip->size );
+  ip->too_long = false;
+  ip->bytes = 0;
+  while( p < end )
+    {
+    const char * nl = (const char *)memchr( p, '\n', end - p );
+    if( !nl ) nl = end;			/* unterminated last line of file */
+    long len = nl - p;
+    if( len > max_line_len ) { ip->too_long = true; break; }
+    line_node * const np =
+      ip->threaded ? alloc_part_node( ip ) : alloc_line_node();
+    if( !np ) break;
+    const long pos = ip->pos + ( p - ip->buf );
+    if( strip && nl < end && len > 0 && nl[-1] == '\r' ) --len;
+    set_node_text( np, ip->mapped ? -pos - 1 : pos, len );
+    ip->bytes += len + 1;
+    lp->right = np; lp = np; ++n;
+    p = nl + 1;
+    }
+  line_node * first = chain.right;
+  ip->root = build_tree( &first, n ); ip->last = n ? lp : 0; ip->n = n;
+  if( p < end ) { free_index_parts( ip, 1 ); ip->root = 0; ip->n = -1; }
+  return 0;
+  }
+
+
+/* Insert the lines of text in buf, whose text is at position pos, in the
+   editor buffer after the current line as a whole.
+   Large runs are split in parts at line boundaries, which are indexed by
+   up to 'jobs()' threads concurrently and then joined in order.
+   Make *upp the undo atom of the new lines, or extend it with them if
+   *upp != 0. Return the size of the lines inserted, including newlines,
+   or -1 if error.
+*/
+static long insert_run( const char * const buf, const long size,
+                        const long pos, const bool mapped,
+                        undo_atom ** const upp )
+  {
+  enum { min_part_size = 1 << 20 };
+  Index_part parts[max_jobs];
+  const int nparts = max( 1, min( jobs(), size / min_part_size ) );
+  long bytes = 0, n = 0;
+  int i;
+
+  const char * p = buf;
+  for( i = 0; i < nparts; ++i )		/* split buf at line boundaries */
+    {
+    const char * end = buf + size * ( i + 1 ) / nparts;
+    if( end <= p ) end = p;
     else
-      {
-      up = push_undo_atom( UADD, current_addr_, current_addr_ );
-      if( !up ) { enable_interrupts(); return false; }
-      }
-    modified_ = true;
-    lp = lp->q_forw;
-    enable_interrupts();
+      { end = (const char *)memchr( end - 1, '\n', buf + size - end + 1 );
+        end = end ? end + 1 : buf + size; }
+    parts[i].buf = p; parts[i].size = end - p; parts[i].pos = pos + ( p - buf );
+    parts[i].mapped = mapped; parts[i].threaded = nparts > 1;
+    parts[i].slabs = 0; parts[i].root = 0;
+    p = end;
     }
-  return true;
+  if( nparts > 1 )
+    run_jobs( index_part, parts, sizeof parts[0], nparts );
+  else index_part( parts );
+  for( i = 0; i < nparts; ++i )
+    { if( parts[i].n < 0 ) break; n += parts[i].n; bytes += parts[i].bytes;
+      if( parts[i].has_nul ) isbinary_ = true; }
+  if( i < nparts || last_addr_ + n > max_lines )
+    {
+    if( i >= nparts ) set_error_msg( "Too many lines in buffer" );
+    else if( parts[i].too_long ) set_error_msg( "Line too long" );
+    else { show_strerror( 0, ENOMEM ); set_error_msg( mem_msg ); }
+    free_index_parts( parts, nparts );
+    return -1;
+    }
+  line_node * lp = 0;			/* last new node */
+  line_node * root = 0;
+  for( i = 0; i < nparts; ++i )
+    while( parts[i].slabs )
+      { Node_slab * const sp = parts[i].slabs; parts[i].slabs = sp->next;
+        sp->next = 0; add_slab( sp ); }
+  for( i = 0; i < nparts; ++i )
+    if( parts[i].n > 0 )
+      { lp = parts[i].last; root = merge_trees( root, parts[i].root ); }
+  return insert_new_tree( root, lp, n, upp ) ? bytes : -1;
   }
 
 
-/* Write a line of text to the scratch file and add a line node to the
-   editor buffer.
-   The text line stops at the first newline and may be shorter than size.
-   Return a pointer to the char following the newline in buf, or 0 if error.
+/* Write the lines of text in buf to the scratch buffer in one operation,
+   and insert them in the editor buffer after the current line as a whole.
+   The text must end with a newline. Make *upp the undo atom of the new
+   lines, or extend it with them if *upp != 0.
+   Return the number of lines inserted, or -1 if error.
 */
-const char * put_sbuf_line( const char * const buf, const int size )
+long put_sbuf_lines( const char * const buf, const long size,
+                     undo_atom ** const upp )
   {
-  const char * const p = (const char *) memchr( buf, '\n', size );
-  if( !p )
-    { set_error_msg( "internal error: unterminated line passed to put_sbuf_line" );
-      return 0; }
-  const int len = p - buf;
-  if( too_many_lines() ) return 0;
+  if( size <= 0 || buf[size-1] != '\n' )
+    { set_error_msg(
+        "internal error: unterminated line passed to put_sbuf_lines" );
+      return -1; }
+  if( dedup_lines() )			/* write only the new lines */
+    {
+    if( !put_sbuf_text( buf, size ) ) { discard_sbuf_text(); return -1; }
+    return insert_sbuf_text( upp );
+    }
+  const long o_last_addr = last_addr_;
+  const long pos = write_sbuf( buf, size );	/* assert: interrupts disabled */
+  if( pos < 0 || insert_run( buf, size, pos, false, upp ) < 0 ) return -1;
+  return last_addr_ - o_last_addr;
+  }
+
+
+/* With --dedup-lines, the lines passed whole to put_sbuf_text are looked
+   up by content in a hash table of the lines already written, and a line
+   equal to one of them shares its text instead of being written again.
+   The table is emptied when the scratch buffer is compacted, because the
+   text moves. If the table can't grow, lines are just not shared. */
+
+static uint32_t hash_text( const char * p, long len )
+  {
+  const uint64_t k = 0x9E3779B97F4A7C15ULL;
+  uint64_t h = len * k, v;
+
+  for( ; len >= 8; p += 8, len -= 8 )
+    { memcpy( &v, p, 8 ); h = ( h ^ v ) * k; h ^= h >> 32; }
+  if( len > 0 ) { v = 0; memcpy( &v, p, len ); h = ( h ^ v ) * k; }
+  h ^= h >> 33; h *= 0xFF51AFD7ED558CCDULL;
+  return h ^ ( h >> 32 );
+  }
+
+
+/* return the first slot to probe for hash h in a table of slots slots */
+static long hash_slot( const uint32_t h, const long slots )
+  { return ( (uint64_t)h * 0x9E3779B97F4A7C15ULL ) >> 32 & ( slots - 1 ); }
+
+
+/* return true if the len bytes at position pos of the scratch buffer are
+   equal to text */
+static bool sbuf_text_equal( long pos, const char * text, long len )
+  {
+  enum { block_size = 1 << 16 };
+  static char buf[block_size];
 
-  if( seek_write )				/* out of position */
+  while( len > 0 )
     {
-    if( fseek( sfp, 0L, SEEK_END ) != 0 )
-      {
-      show_strerror( 0, errno );
-      set_error_msg( "Cannot seek temp file" );
-      return 0;
-      }
-    sfpos = ftell( sfp );
-    seek_write = false;
+    const int n = min( len, (long)block_size );
+    if( !read_scratch( buf, pos, n ) || memcmp( buf, text, n ) != 0 )
+      return false;
+    pos += n; text += n; len -= n;
+    }
+  return true;
+  }
+
+
+/* Return the position in the scratch buffer of a copy of the len bytes of
+   text, whose hash is h, or -1 if not found. */
+static long find_dedup_text( const char * const text, const long len,
+                             const uint32_t h )
+  {
+  long i;
+
+  if( !dedup_table ) return -1;
+  for( i = hash_slot( h, dedup_slots ); dedup_table[i].len > 0;
+       i = ( i + 1 ) & ( dedup_slots - 1 ) )
+    {
+    const Dedup_entry * const ep = &dedup_table[i];
+    if( ep->hash == h && ep->len == len &&
+        sbuf_text_equal( ep->pos, text, len ) ) return ep->pos;
     }
-  if( (int)fwrite( buf, 1, len, sfp ) != len )	/* assert: interrupts disabled */
+  return -1;
+  }
+
+
+static void add_dedup_text( const long pos, const long len, const uint32_t h )
+  {
+  long i;
+
+  if( 2 * ( dedup_used + 1 ) > dedup_slots )	/* grow the table */
     {
-    sfpos = -1;
-    show_strerror( 0, errno );
-    set_error_msg( "Cannot write temp file" );
-    return 0;
+    const long slots = max( 1024L, 2 * dedup_slots );
+    Dedup_entry * const table =
+      (Dedup_entry *)calloc( slots, sizeof (Dedup_entry) );
+    if( !table ) return;
+    for( i = 0; i < dedup_slots; ++i )
+      if( dedup_table[i].len > 0 )
+        {
+        long j = hash_slot( dedup_table[i].hash, slots );
+        while( table[j].len > 0 ) j = ( j + 1 ) & ( slots - 1 );
+        table[j] = dedup_table[i];
+        }
+    free( dedup_table ); dedup_table = table; dedup_slots = slots;
     }
-  line_node * lp = dup_line_node( 0 );
-  if( !lp ) return 0;
-  lp->pos = sfpos; lp->len = len;
-  add_line_node( lp );
-  sfpos += len;				/* update file position */
-  return p + 1;
+  for( i = hash_slot( h, dedup_slots ); dedup_table[i].len > 0;
+       i = ( i + 1 ) & ( dedup_slots - 1 ) ) ;
+  dedup_table[i].hash = h; dedup_table[i].pos = pos; dedup_table[i].len = len;
+  ++dedup_used;
   }
 
 
-/* return pointer to a line node in the editor buffer */
-line_node * search_line_node( const int addr )
+static void clear_dedup_table( const bool release )
   {
-  static line_node * lp = &buffer_head;
-  static int o_addr = 0;
+  if( release ) { free( dedup_table ); dedup_table = 0; dedup_slots = 0; }
+  else if( dedup_table )
+    memset( dedup_table, 0, dedup_slots * sizeof (Dedup_entry) );
+  dedup_used = 0;
+  }
 
-  disable_interrupts();
-  if( o_addr < addr )
+
+/* New lines whose text is written to the scratch buffer by put_sbuf_text.
+   The text of a line may be written in several parts, and is contiguous
+   because nothing else is written to the scratch buffer meanwhile. */
+static line_node text_chain;		/* list of the finished lines */
+static line_node * text_last = &text_chain;
+static long text_lines = 0;
+static long text_pos = -1;		/* position of the unfinished line */
+static long text_len = 0;
+
+/* Append the text in buf, which may contain newlines, to the new lines.
+   Each newline finishes a line. Return false if error. */
+bool put_sbuf_text( const char * buf, long size )
+  {
+  while( size > 0 )			/* assert: interrupts disabled */
     {
-    if( o_addr + last_addr_ >= 2 * addr )
-      while( o_addr < addr ) { ++o_addr; lp = lp->q_forw; }
+    const char * const nl = (const char *)memchr( buf, '\n', size );
+    const long len = nl ? nl + 1 - buf : size;
+    if( text_len + len - ( nl != 0 ) > max_line_len )
+      { set_error_msg( "Line too long" ); return false; }
+    const bool whole = nl && text_pos < 0 && dedup_lines() &&
+                       len - 1 <= UINT32_MAX;
+    const uint32_t h = whole ? hash_text( buf, len - 1 ) : 0;
+    long pos = -1;
+    if( whole ) pos = ( len > 1 ) ? find_dedup_text( buf, len - 1, h ) : 0;
+    if( pos >= 0 ) { ++lines_shared; bytes_shared += len; }
     else
       {
-      lp = buffer_head.q_back; o_addr = last_addr_;
-      while( o_addr > addr ) { --o_addr; lp = lp->q_back; }
+      pos = write_sbuf( buf, len );
+      if( pos < 0 ) return false;
+      if( whole ) add_dedup_text( pos, len - 1, h );
+      }
+    if( text_pos < 0 ) text_pos = pos;
+    text_len += len;
+    if( nl )
+      {
+      if( text_lines >= max_lines )
+        { set_error_msg( "Too many lines in buffer" ); return false; }
+      line_node * const lp = alloc_line_node();
+      if( !lp )
+        { show_strerror( 0, errno ); set_error_msg( mem_msg ); return false; }
+      set_node_text( lp, text_pos, text_len - 1 );
+      text_last->right = lp; text_last = lp; ++text_lines;
+      text_pos = -1; text_len = 0;
       }
+    buf += len; size -= len;
+    }
+  return true;
+  }
+
+
+/* free the new lines written by put_sbuf_text */
+void discard_sbuf_text( void )
+  {
+  line_node * lp = text_chain.right;
+  for( ; text_lines > 0; --text_lines )
+    { line_node * const np = lp->right; free_line_node( lp ); lp = np; }
+  text_last = &text_chain; text_pos = -1; text_len = 0;
+  }
+
+
+/* Insert the new lines written by put_sbuf_text in the editor buffer
+   after the current line. The last line must be finished. Make *upp the
+   undo atom of the new lines, or extend it with them if *upp != 0.
+   Return the number of lines inserted, or -1 if error. */
+long insert_sbuf_text( undo_atom ** const upp )
+  {
+  const long n = text_lines;
+
+  if( last_addr_ + n > max_lines )
+    { set_error_msg( "Too many lines in buffer" );
+      discard_sbuf_text(); return -1; }
+  line_node * first = text_chain.right;
+  line_node * const lp = text_last;
+  line_node * const root = build_tree( &first, n );
+  text_last = &text_chain; text_lines = 0;
+  if( n > 0 && !insert_new_tree( root, lp, n, upp ) ) return -1;
+  return n;
+  }
+
+
+/* Insert the lines of text in buf, which is in the last file mapped by
+   map_sbuf_file, without copying them to the scratch buffer. Only the last
+   line of the file may lack a newline. NULs in buf make the buffer binary,
+   and the CRs of CR/LF pairs are stripped if strip_cr().
+   Return the size of the lines inserted, counting one newline per line,
+   or -1 if error.
+*/
+long put_mapped_lines( const char * const buf, const long size,
+                       undo_atom ** const upp )
+  {
+  const Mapped_file * const mf = &mfiles[mfiles_len-1];
+  return insert_run( buf, size, mf->base + ( buf - mf->map ), true, upp );
+  }
+
+
+/* return pointer to a line node in the editor buffer */
+line_node * search_line_node( long addr )
+  {
+  line_node * lp = buffer_root;
+
+  if( addr <= 0 || addr > last_addr_ ) return &buffer_head;
+  disable_interrupts();
+  while( true )
+    {
+    const long n = node_size( lp->left );
+    if( addr <= n ) lp = lp->left;
+    else if( addr == n + 1 ) break;
+    else { addr -= n + 1; lp = lp->right; }
     }
-  else if( o_addr <= 2 * addr )
-    while( o_addr > addr ) { --o_addr; lp = lp->q_back; }
-  else
-    { lp = &buffer_head; o_addr = 0;
-      while( o_addr < addr ) { ++o_addr; lp = lp->q_forw; } }
   enable_interrupts();
   return lp;
   }
 
 
 /* copy a range of lines to the cut buffer */
-bool yank_lines( const int from, const int to )
+bool yank_lines( const long from, const long to )
   {
-  line_node * const ep = search_line_node( inc_addr( to ) );
-  line_node * bp = search_line_node( from );
-  line_node * lp = &yank_buffer_head;
+  line_node * last;
 
   clear_yank_buffer();
-  while( bp != ep )
-    {
-    disable_interrupts();
-    line_node * p = dup_line_node( bp );
-    if( !p ) { enable_interrupts(); return false; }
-    insert_node( p, lp );
-    bp = bp->q_forw; lp = p;
-    enable_interrupts();
-    }
-  return true;
+  disable_interrupts();
+  yank_root = dup_lines( search_line_node( from ), to - from + 1, &last );
+  enable_interrupts();
+  return yank_root != 0;
+  }
+
+
+/* Give the yank buffer its own copy of the lines it shares with the undo
+   stack. Return false if error. */
+static bool unshare_yank_buffer( void )
+  {
+  line_node * last;
+
+  if( !yank_shared ) return true;
+  disable_interrupts();
+  line_node * const t =
+    dup_lines( first_node( yank_root ), node_size( yank_root ), &last );
+  if( t ) { yank_root = t; yank_shared = false; }
+  enable_interrupts();
+  return t != 0;
   }
 
 
 static undo_atom * ustack = 0;		/* undo stack */
-static int usize = 0;			/* ustack size (in bytes) */
-static int u_len = 0;			/* undo stack size (in atoms) */
-static int u_current_addr = -1;		/* if < 0, undo disabled */
-static int u_last_addr = -1;		/* if < 0, undo disabled */
+static long usize = 0;			/* ustack size (in bytes) */
+static long u_len = 0;			/* undo stack size (in atoms) */
+static long u_current_addr = -1;	/* if < 0, undo disabled */
+static long u_last_addr = -1;		/* if < 0, undo disabled */
 static bool u_modified = false;
 
 
@@ -540,16 +1372,9 @@ void clear_undo_stack( void )
   while( u_len-- )
     if( ustack[u_len].type == UDEL )
       {
-      line_node * const ep = ustack[u_len].tail->q_forw;
-      line_node * bp = ustack[u_len].head;
-      while( bp != ep )
-        {
-        line_node * const lp = bp->q_forw;
-        unmark_line_node( bp );
-        unmark_unterminated_line( bp );
-        free( bp );
-        bp = lp;
-        }
+      line_node * const t = node_root( ustack[u_len].head, 0 );
+      if( yank_shared && t == yank_root ) yank_shared = false;
+      else free_tree( t, true );
       }
   u_len = 0;
   u_current_addr = current_addr_;
@@ -580,18 +1405,17 @@ static void free_undo_stack( void )
 
 
 /* return pointer to intialized undo atom */
-undo_atom * push_undo_atom( const int type, const int from, const int to )
+undo_atom * push_undo_atom( const int type, const long from, const long to )
   {
-  const unsigned min_size = ( u_len + 1 ) * sizeof (undo_atom);
+  const long min_size = ( u_len + 1 ) * (long)sizeof (undo_atom);
 
   disable_interrupts();
-  if( (unsigned)usize < min_size )
+  if( usize < min_size )
     {
-    if( min_size >= INT_MAX )
+    if( min_size >= LONG_MAX / 4 )
       { set_error_msg( "Undo stack too long" );
         free_undo_stack(); enable_interrupts(); return 0; }
-    const int new_size = ( ( min_size < 512 ) ? 512 :
-      ( min_size >= INT_MAX / 2 ) ? INT_MAX - 1 : ( min_size / 512 ) * 1024 );
+    const long new_size = ( min_size < 512 ) ? 512 : ( min_size / 512 ) * 1024;
     void * new_buf = 0;
     if( ustack ) new_buf = realloc( ustack, new_size );
     else new_buf = malloc( new_size );
@@ -602,6 +1426,7 @@ undo_atom * push_undo_atom( const int type, const int from, const int to )
     ustack = (undo_atom *)new_buf;
     }
   ustack[u_len].type = type;
+  ustack[u_len].addr = from - 1;
   ustack[u_len].tail = search_line_node( to );
   ustack[u_len].head = search_line_node( from );
   enable_interrupts();
@@ -612,29 +1437,35 @@ undo_atom * push_undo_atom( const int type, const int from, const int to )
 /* undo last change to the editor buffer */
 bool undo( const bool isglobal )
   {
-  int n;
-  const int o_current_addr = current_addr_;
-  const int o_last_addr = last_addr_;
+  long n;
+  const long o_current_addr = current_addr_;
+  const long o_last_addr = last_addr_;
   const bool o_modified = modified();
 
   if( u_len <= 0 || u_current_addr < 0 || u_last_addr < 0 )
     { set_error_msg( "Nothing to undo" ); return false; }
-  search_line_node( 0 );		/* reset cached value */
+  if( !unshare_yank_buffer() ) return false;
   disable_interrupts();
   for( n = u_len - 1; n >= 0; --n )
     {
-    switch( ustack[n].type )
+    undo_atom * const up = ustack + n;
+    switch( up->type )
       {
-      case UADD: link_nodes( ustack[n].head->q_back, ustack[n].tail->q_forw );
+      case UADD: up->addr = node_addr( up->head, false ) - 1;
+                 remove_tree( up->addr + 1, node_addr( up->tail, false ) );
                  break;
-      case UDEL: link_nodes( ustack[n].head->q_back, ustack[n].head );
-                 link_nodes( ustack[n].tail, ustack[n].tail->q_forw );
+      case UDEL: insert_tree( node_root( up->head, 0 ), up->addr );
                  break;
       case UMOV:
-      case VMOV: link_nodes( ustack[n-1].head, ustack[n].head->q_forw );
-                 link_nodes( ustack[n].tail->q_back, ustack[n-1].tail );
-                 link_nodes( ustack[n].head, ustack[n].tail ); --n;
-                 break;
+      case VMOV: {
+                 const long first = node_addr( up->head, false ) + 1;
+                 const long last = node_addr( up->tail, true ) - 1;
+                 long addr = node_addr( up[-1].head, false );
+                 if( addr > last ) addr -= last - first + 1;
+                 --n;
+                 if( first <= last )
+                   insert_tree( remove_tree( first, last ), addr );
+                 } break;
       }
     ustack[n].type ^= 1;
     }
@@ -651,3 +1482,105 @@ bool undo( const bool isglobal )
   enable_interrupts();
   return true;
   }
+
+
+/* The scratch buffer is append-only, so the text of the lines replaced or
+   deleted stays there after their nodes are freed. free_line_node counts
+   that text in sbuf_dead; this is an estimate because the copies of a line
+   made by 't' or 'y', and the lines shared by --dedup-lines, share its
+   text. compact_sbuf moves the text still referenced by the editor
+   buffer, the undo stack, and the yank buffer to the start of the scratch
+   buffer and truncates it. Line nodes are not moved; only their positions
+   change. */
+
+/* Append to v the nodes of tree t whose text is in the scratch buffer.
+   Lines of mapped files already copied to the scratch buffer are turned
+   into ordinary scratch lines. Return the new number of nodes in v. */
+static long collect_sbuf_nodes( line_node ** const v, long n,
+                                line_node * const t )
+  {
+  line_node * lp;
+
+  for( lp = first_node( t ); lp; lp = next_node( lp ) )
+    {
+    long pos = node_pos( lp );
+    if( pos < 0 )
+      {
+      const Mapped_file * const mf = find_mfile( -pos - 1 );
+      if( mf->map ) continue;
+      pos = mf->spos + ( -pos - 1 - mf->base );
+      }
+    set_node_text( lp, node_len( lp ) > 0 ? pos : 0, node_len( lp ) );
+    if( node_len( lp ) > 0 ) v[n++] = lp;
+    }
+  return n;
+  }
+
+
+static int compare_node_pos( const void * const a, const void * const b )
+  {
+  const line_node * const p = *(line_node * const *)a;
+  const line_node * const q = *(line_node * const *)b;
+  return ( node_pos( p ) > node_pos( q ) ) - ( node_pos( p ) < node_pos( q ) );
+  }
+
+
+/* Compact the scratch buffer. If force is false, do it only if the dead
+   text is larger than the live text and than min_dead_size.
+   Return false if error. */
+bool compact_sbuf( const bool force )
+  {
+  enum { min_dead_size = 1 << 24 };
+  static long failed_size = -1;		/* size when automatic one failed */
+  const long old_size = scratch_size();
+  long n = 0, i, j, k, w = 0;
+
+  if( !force && ( sbuf_dead < min_dead_size ||
+                  sbuf_dead <= scratch_size() - sbuf_dead ||
+                  scratch_size() == failed_size ) ) return true;
+  line_node ** const v =
+    (line_node **)malloc( max( nodes_in_use, 1L ) * sizeof (line_node *) );
+  if( !v ) { show_strerror( 0, errno ); set_error_msg( mem_msg );
+             return false; }
+  disable_interrupts();
+  n = collect_sbuf_nodes( v, n, buffer_root );
+  if( !yank_shared ) n = collect_sbuf_nodes( v, n, yank_root );
+  for( k = 0; k < u_len; ++k )
+    if( ustack[k].type == UDEL )
+      n = collect_sbuf_nodes( v, n, node_root( ustack[k].head, 0 ) );
+  qsort( v, n, sizeof v[0], compare_node_pos );
+  /* Move together the text of consecutive lines and the newline between
+     them, and the text shared by several nodes. If a move fails halfway,
+     the text moved may have overwritten its own source. So a group whose
+     destination overlaps its source is first copied to the end of the
+     scratch buffer, and its nodes point to the copy until it is moved. */
+  for( i = 0; i < n; i = j )
+    {
+    const long start = node_pos( v[i] );
+    long end = start + node_len( v[i] );
+    for( j = i + 1; j < n && node_pos( v[j] ) <= end + 1; ++j )
+      end = max( end, node_pos( v[j] ) + node_len( v[j] ) );
+    const long len = end - start;
+    long src = start;
+    if( w < start && start - w < len )
+      {
+      if( ( src = copy_scratch( start, len ) ) < 0 ) break;
+      for( k = i; k < j; ++k )
+        set_node_text( v[k], node_pos( v[k] ) + ( src - start ),
+                       node_len( v[k] ) );
+      sbuf_dead += len;
+      }
+    if( !move_scratch( w, src, len ) ) break;
+    for( ; i < j; ++i )
+      set_node_text( v[i], node_pos( v[i] ) - ( src - w ), node_len( v[i] ) );
+    w += len;
+    }
+  free( v );
+  clear_dedup_table( false );
+  const bool ok = i >= n && truncate_scratch( w );
+  if( ok ) { ++compactions; bytes_reclaimed += old_size - w; sbuf_dead = 0;
+             failed_size = -1; }
+  else if( !force ) failed_size = scratch_size();
+  enable_interrupts();
+  return ok;
+  }
@@ -18,6 +18,7 @@
 */
 
 #include <stdbool.h>
+#include <stdint.h>
 
 enum Pflags			/* print suffixes */
   {
@@ -27,22 +28,66 @@ enum Pflags			/* print suffixes */
   };
 
 
+/* The position and length of the text of a line, and the size of the
+   subtree of the node, are packed in two 64-bit words to keep the node
+   small. The position (signed) takes the low pos_bits of pos_len, the size
+   takes the low size_bits of size_len, and the length takes the remaining
+   high bits of both words. Use the functions below to access them. */
+enum { pos_bits = 48, size_bits = 40, len_low_bits = 64 - size_bits };
+
 typedef struct line_node		/* Line node */
   {
-  struct line_node * q_forw;
-  struct line_node * q_back;
-  long pos;			/* position of text in scratch buffer */
-  int len;			/* length of line ('\n' is not stored) */
+  struct line_node * left;	/* links of the order-statistic tree */
+  struct line_node * right;
+  struct line_node * parent;
+  uint64_t pos_len;		/* position and high bits of length */
+  uint64_t size_len;		/* subtree size and low bits of length */
   }
 line_node;
 
+/* Limits of the packed node. Where long is 32 bits they are clamped to
+   LONG_MAX, so <limits.h> must be included before this file. */
+#if LONG_MAX >> 31 >> 31 != 0
+static const long max_line_pos = ( 1L << ( pos_bits - 1 ) ) - 1;
+static const long max_line_len = ( 1L << ( 128 - pos_bits - size_bits ) ) - 1;
+static const long max_lines = ( 1L << size_bits ) - 3;
+#else
+static const long max_line_pos = LONG_MAX;
+static const long max_line_len = LONG_MAX;
+static const long max_lines = LONG_MAX - 3;
+#endif
+
+/* position of text in scratch buffer, or -( position + 1 ) in the mapped
+   files */
+static inline long node_pos( const line_node * const lp )
+  {
+  const int64_t sign = (int64_t)1 << ( pos_bits - 1 );
+  const int64_t pos = lp->pos_len & ( ( (uint64_t)1 << pos_bits ) - 1 );
+  return ( pos ^ sign ) - sign;
+  }
+
+/* length of line ('\n' is not stored) */
+static inline long node_len( const line_node * const lp )
+  { return ( lp->pos_len >> pos_bits << len_low_bits ) |
+           ( lp->size_len >> size_bits ); }
+
+static inline void set_node_text( line_node * const lp, const long pos,
+                                  const long len )
+  {
+  lp->pos_len = ( (uint64_t)pos & ( ( (uint64_t)1 << pos_bits ) - 1 ) ) |
+                (uint64_t)len >> len_low_bits << pos_bits;
+  lp->size_len = ( lp->size_len & ( ( (uint64_t)1 << size_bits ) - 1 ) ) |
+                 (uint64_t)len << size_bits;
+  }
+
 
 enum { UADD = 0, UDEL = 1, UMOV = 2, VMOV = 3 };
 typedef struct undo_atom		/* Undo atom */
   {
   int type;
-  line_node * head;			/* head of list */
-  line_node * tail;			/* tail of list */
+  long addr;				/* line after which UDEL lines go */
+  line_node * head;			/* first line of range */
+  line_node * tail;			/* last line of range */
   }
 undo_atom;
 
@@ -53,41 +98,59 @@ undo_atom;
 #define min( a, b ) ( (( a ) < ( b )) ? ( a ) : ( b ) )
 #endif
 
+enum { max_jobs = 64 };			/* maximum number of worker threads */
+
 static const char * const mem_msg = "Memory exhausted";
 static const char * const no_prev_subst = "No previous substitution";
 
 /* defined in buffer.c */
-bool append_lines( const char ** const ibufpp, const int addr,
+bool append_lines( const char ** const ibufpp, const long addr,
                    bool insert, const bool isglobal );
 bool close_sbuf( void );
-bool copy_lines( const int first_addr, const int second_addr, const int addr );
-int current_addr( void );
-int dec_addr( int addr );
-bool delete_lines( const int from, const int to, const bool isglobal );
-int get_line_node_addr( const line_node * const lp );
+bool compact_sbuf( const bool force );
+bool copy_lines( const long first_addr, const long second_addr,
+                 const long addr );
+long current_addr( void );
+long dec_addr( long addr );
+bool delete_lines( const long from, const long to, const bool isglobal );
+void discard_sbuf_text( void );
+long get_line_node_addr( const line_node * const lp );
 char * get_sbuf_line( const line_node * const lp );
-int inc_addr( int addr );
-int inc_current_addr( void );
+const char * get_sbuf_line_part( const line_node * const lp, const long off,
+                                 long * const sizep );
+const char * get_sbuf_line_shared( const line_node * const lp,
+                                   const long off, long * const sizep );
+long inc_addr( long addr );
+long inc_current_addr( void );
 bool init_buffers( void );
+long insert_sbuf_text( undo_atom ** const upp );
 bool isbinary( void );
-bool join_lines( const int from, const int to, const bool isglobal );
-int last_addr( void );
+bool join_lines( const long from, const long to, const bool isglobal );
+long last_addr( void );
+const char * map_sbuf_file( const int fd, long * const sizep );
 bool modified( void );
 bool warned( void );
-bool move_lines( const int first_addr, const int second_addr, const int addr,
-                 const bool isglobal );
+bool move_lines( const long first_addr, const long second_addr,
+                 const long addr, const bool isglobal );
+line_node * next_line_node( const line_node * const lp );
 bool open_sbuf( void );
+void print_buffer_stats( void );
 int path_max( const char * filename );
-bool put_lines( const int addr );
-const char * put_sbuf_line( const char * const buf, const int size );
-line_node * search_line_node( const int addr );
+bool put_lines( const long addr );
+long put_mapped_lines( const char * const buf, const long size,
+                       undo_atom ** const upp );
+long put_sbuf_lines( const char * const buf, const long size,
+                     undo_atom ** const upp );
+bool put_sbuf_text( const char * buf, long size );
+line_node * search_line_node( const long addr );
 void set_binary( void );
-void set_current_addr( const int addr );
+void set_current_addr( const long addr );
 void set_modified( const bool b );
 void set_warned( const bool b );
-bool yank_lines( const int from, const int to );
+bool unmap_sbuf_files( const char * const filename );
+bool yank_lines( const long from, const long to );
 void clear_undo_stack( void );
-undo_atom * push_undo_atom( const int type, const int from, const int to );
+undo_atom * push_undo_atom( const int type, const long from, const long to );
 void reset_undo_state( void );
 bool undo( const bool isglobal );
 
@@ -99,25 +162,36 @@ void unset_active_nodes( const line_node * bp, const line_node * const ep );
 
 /* defined in io.c */
 unsigned char escchar( const unsigned char ch );
-bool get_extended_line( const char ** const ibufpp, int * const lenp,
+bool get_extended_line( const char ** const ibufpp, long * const lenp,
                         const bool strip_escaped_newlines );
-const char * get_stdin_line( int * const sizep );
+const char * get_stdin_line( long * const sizep );
 int linenum( void );
-bool print_lines( int from, const int to, const int pflags );
-int read_file( const char * const filename, const int addr,
-               bool * const read_onlyp );
-int write_file( const char * const filename, const char * const mode,
-                const int from, const int to );
+bool print_lines( long from, const long to, const int pflags );
+long read_file( const char * const filename, const long addr,
+                bool * const read_onlyp );
+long write_file( const char * const filename, const char * const mode,
+                 const long from, const long to );
 void reset_unterminated_line( void );
 void unmark_unterminated_line( const line_node * const lp );
 
+/* defined in lzcodec.c */
+long lz_compress( const char * const src, const long size, char * const dst,
+                  const long cap );
+long lz_decompress( const char * const src, const long size, char * const dst,
+                    const long cap );
+
 /* defined in main.c */
+bool dedup_lines( void );
 bool extended_regexp( void );
+bool index_file( void );
 bool interactive();
+int jobs( void );
+bool map_files( void );
 bool may_access_filename( const char * const name );
 void print_escaped( const char * p, const bool to_stdout );
 bool restricted( void );
 bool scripted( void );
+long scratch_mem( void );
 void show_strerror( const char * const filename, const int errcode );
 void show_warning( const char * const filename, const char * const msg );
 bool strip_cr( void );
@@ -125,7 +199,7 @@ bool traditional( void );
 
 /* defined in main_loop.c */
 const char * error_msg( void );
-int first_e_command( const char * const filename );
+long first_e_command( const char * const filename );
 void invalid_address( void );
 int main_loop( const bool initial_error, const bool loose );
 bool set_def_filename( const char * const s );
@@ -135,22 +209,42 @@ void set_verbose( void );
 void unmark_line_node( const line_node * const lp );
 
 /* defined in regex.c */
-bool build_active_list( const char ** const ibufpp, const int first_addr,
-                        const int second_addr, const bool match );
+bool build_active_list( const char ** const ibufpp, const long first_addr,
+                        const long second_addr, const bool match );
 const char * get_pattern_for_s( const char ** const ibufpp );
 bool extract_replacement( const char ** const ibufpp, const bool isglobal );
-int next_matching_node_addr( const char ** const ibufpp );
-bool search_and_replace( const int first_addr, const int second_addr,
+void print_regex_stats( void );
+long next_matching_node_addr( const char ** const ibufpp );
+bool search_and_replace( const long first_addr, const long second_addr,
                          const int snum, const bool isglobal );
 bool set_subst_regex( const char * const pat, const bool ignore_case );
 bool replace_subst_re_by_search_re( void );
 bool subst_regex( void );
 
+/* defined in scratch.c */
+long append_scratch( const char * const buf, const long len );
+bool close_scratch( void );
+long copy_scratch( long src, long len );
+int create_temp_file( void );
+const char * get_scratch_part( const long pos, long * const sizep );
+bool move_scratch( long dst, long src, long len );
+bool open_scratch( void );
+void pin_sbuf( const bool pin );
+void print_scratch_stats( void );
+bool read_scratch( char * const buf, const long pos, const long len );
+bool scratch_shared( void );
+long scratch_size( void );
+bool set_scratch_backend( const char * const name );
+bool truncate_scratch( const long size );
+const char * view_scratch_shared( const long pos, long * const sizep );
+
 /* defined in signal.c */
 void disable_interrupts( void );
 void enable_interrupts( void );
 const char * home_directory( void );
-bool resize_buffer( char ** const buf, int * const size, const unsigned min_size );
+bool resize_buffer( char ** const buf, long * const size, const long min_size );
+void run_jobs( void * (*worker)( void * ), void * const args,
+               const int arg_size, const int n );
 void set_signals( void );
 void set_window_lines( const int lines );
 int window_columns( void );
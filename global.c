@@ -26,10 +26,10 @@
 
 /* list of lines active in a global command */
 static const line_node **active_list = 0;
-static int active_size = 0;	/* size (in bytes) of active_list */
-static int active_len = 0;	/* number of lines in active_list */
-static int active_idx = 0;	/* active_list index ( non-decreasing ) */
-static int active_idxm = 0;	/* active_list index ( modulo active_len ) */
+static long active_size = 0;	/* size (in bytes) of active_list */
+static long active_len = 0;	/* number of lines in active_list */
+static long active_idx = 0;	/* active_list index ( non-decreasing ) */
+static long active_idxm = 0;	/* active_list index ( modulo active_len ) */
 
 
 /* clear the global-active list */
@@ -55,13 +55,12 @@ const line_node * next_active_node( void )
 /* add a line node to the global-active list */
 bool set_active_node( const line_node * const lp )
   {
-  const unsigned min_size = ( active_len + 1 ) * sizeof (line_node **);
-  if( (unsigned)active_size < min_size )
+  const long min_size = ( active_len + 1 ) * (long)sizeof (line_node **);
+  if( active_size < min_size )
     {
-    if( min_size >= INT_MAX )
+    if( min_size >= LONG_MAX / 4 )
       { set_error_msg( "Too many matching lines" ); return false; }
-    const int new_size = ( ( min_size < 512 ) ? 512 :
-      ( min_size >= INT_MAX / 2 ) ? INT_MAX - 1 : ( min_size / 512 ) * 1024 );
+    const long new_size = ( min_size < 512 ) ? 512 : ( min_size / 512 ) * 1024;
     void * new_buf = 0;
     disable_interrupts();
     if( active_list ) new_buf = realloc( active_list, new_size );
@@ -83,13 +82,13 @@ void unset_active_nodes( const line_node * bp, const line_node * const ep )
   {
   while( bp != ep )
     {
-    int i;
+    long i;
     for( i = 0; i < active_len; ++i )
       {
       if( ++active_idxm >= active_len ) active_idxm = 0;
       if( active_list[active_idxm] == bp )
         { active_list[active_idxm] = 0; break; }
       }
-    bp = bp->q_forw;
+    bp = next_line_node( bp );
     }
   }
@@ -18,8 +18,10 @@
 */
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "ed.h"
 
@@ -47,12 +49,10 @@ unsigned char escchar( const unsigned char ch )
   return ( ch && p ) ? escchars[p-escapes] : 0;
   }
 
-/* print text to stdout */
-static void print_line( const char * p, int len, const int pflags )
+/* print a part of the text of a line to stdout, starting at column col;
+   return the column reached */
+static int print_text( const char * p, long len, int col, const int pflags )
   {
-  int col = 0;
-
-  if( pflags & pf_n ) { printf( "%d\t", current_addr() ); col = 8; }
   while( --len >= 0 )
     {
     const unsigned char ch = *p++;
@@ -78,13 +78,33 @@ static void print_line( const char * p, int len, const int pflags )
         }
       }
     }
+  return col;
+  }
+
+
+/* print the text of a line to stdout, part by part */
+static bool print_line( const line_node * const lp, const int pflags )
+  {
+  const long len = node_len( lp );
+  long off, size;
+  int col = 0;
+
+  if( pflags & pf_n ) { printf( "%ld\t", current_addr() ); col = 8; }
+  for( off = 0; off < len; off += size )
+    {
+    size = len - off;
+    const char * const s = get_sbuf_line_part( lp, off, &size );
+    if( !s ) return false;
+    col = print_text( s, size, col, pflags );
+    }
   if( !traditional() && ( pflags & pf_l ) ) putchar('$');
   putchar('\n');
+  return true;
   }
 
 
 /* print a range of lines to stdout */
-bool print_lines( int from, const int to, const int pflags )
+bool print_lines( long from, const long to, const int pflags )
   {
   line_node * const ep = search_line_node( inc_addr( to ) );
   line_node * bp = search_line_node( from );
@@ -92,18 +112,16 @@ bool print_lines( int from, const int to, const int pflags )
   if( !from ) { invalid_address(); return false; }
   while( bp != ep )
     {
-    const char * const s = get_sbuf_line( bp );
-    if( !s ) return false;
     set_current_addr( from++ );
-    print_line( s, bp->len, pflags );
-    bp = bp->q_forw;
+    if( !print_line( bp, pflags ) ) return false;
+    bp = next_line_node( bp );
     }
   return true;
   }
 
 
 /* return the parity of escapes at the end of a string */
-static bool trailing_escape( const char * const s, int len )
+static bool trailing_escape( const char * const s, long len )
   {
   bool odd_escape = false;
   while( --len >= 0 && s[len] == '\\' ) odd_escape = !odd_escape;
@@ -116,12 +134,12 @@ static bool trailing_escape( const char * const s, int len )
    The backslashes escaping the newlines are stripped.
    Return line length in *lenp, including the trailing newline.
 */
-bool get_extended_line( const char ** const ibufpp, int * const lenp,
+bool get_extended_line( const char ** const ibufpp, long * const lenp,
                         const bool strip_escaped_newlines )
   {
   static char * buf = 0;
-  static int bufsz = 0;
-  int len;
+  static long bufsz = 0;
+  long len;
 
   for( len = 0; (*ibufpp)[len++] != '\n'; ) ;
   if( len < 2 || !trailing_escape( *ibufpp, len - 1 ) )
@@ -132,7 +150,7 @@ bool get_extended_line( const char ** const ibufpp, int * const lenp,
   if( strip_escaped_newlines ) --len;		/* strip newline */
   while( true )
     {
-    int len2;
+    long len2;
     const char * const s = get_stdin_line( &len2 );
     if( !s ) return false;			/* error */
     if( len2 <= 0 ) return false;		/* EOF */
@@ -155,11 +173,11 @@ bool get_extended_line( const char ** const ibufpp, int * const lenp,
    Return pointer to buffer and line size (including trailing newline),
    or 0 if error, or *sizep = 0 if EOF.
 */
-const char * get_stdin_line( int * const sizep )
+const char * get_stdin_line( long * const sizep )
   {
   static char * buf = 0;
-  static int bufsz = 0;
-  int i = 0;
+  static long bufsz = 0;
+  long i = 0;
 
   while( true )
     {
@@ -192,45 +210,168 @@ const char * get_stdin_line( int * const sizep )
   }
 
 
-/* Read a line of text from a stream.
-   Return pointer to buffer and line size (including trailing newline
-   if it exists and is not added now).
+/* data read from the input stream and not yet returned by read_stream_lines
+   is in rbuf[rbegin,rend) */
+static char * rbuf = 0;
+static long rbufsz = 0;
+static long rbegin = 0, rend = 0;
+
+/* A part of a run of lines, scanned by scan_part. */
+typedef struct
+  {
+  char * buf;			/* text of the part, ending in a newline */
+  long size;			/* size after stripping CRs */
+  bool keep_last_cr;		/* newline of last line was added */
+  bool has_nul;
+  } Scan_part;
+
+/* Detect NULs in a part, and remove CR only from its CR/LF pairs, in
+   place. May run in a worker thread, so it must not report errors. */
+static void * scan_part( void * const arg )
+  {
+  Scan_part * const sp = (Scan_part *)arg;
+  char * const eor = sp->buf + sp->size;
+
+  sp->has_nul = memchr( sp->buf, 0, sp->size ) != 0;
+  if( !strip_cr() ) return 0;
+  char * p = sp->buf;
+  char * q = sp->buf;
+  while( p < eor )
+    {
+    char * const nl = (char *)memchr( p, '\n', eor - p );
+    long len = nl + 1 - p;
+    if( len > 1 && nl[-1] == '\r' &&
+        ( nl + 1 < eor || !sp->keep_last_cr ) )
+      { nl[-1] = '\n'; --len; }
+    if( q != p ) memmove( q, p, len );
+    q += len; p = nl + 1;
+    }
+  sp->size = q - sp->buf;
+  return 0;
+  }
+
+
+/* Scan a run of lines for NULs and CR/LF pairs. Large runs are split in
+   parts at line boundaries, which are scanned by up to 'jobs()' threads
+   concurrently. Return the size of the run after stripping CRs.
 */
-static const char * read_stream_line( const char * const filename,
-                                      FILE * const fp, int * const sizep,
-                                      bool * const newline_addedp )
+static long scan_run( char * const run, const long size,
+                      const bool newline_added )
   {
-  static char * buf = 0;
-  static int bufsz = 0;
-  int c, i = 0;
+  enum { min_part_size = 1 << 20 };
+  Scan_part parts[max_jobs];
+  const int nparts = max( 1, min( jobs(), size / min_part_size ) );
+  char * p = run;
+  int i;
 
-  while( true )
+  for( i = 0; i < nparts; ++i )		/* split run at line boundaries */
     {
-    if( !resize_buffer( &buf, &bufsz, i + 2 ) ) return 0;
-    c = getc( fp ); if( c == EOF ) break;
-    buf[i++] = c;
-    if( c == 0 ) set_binary();
-    else if( c == '\n' )		/* remove CR only from CR/LF pairs */
-      { if( strip_cr() && i > 1 && buf[i-2] == '\r' ) { buf[i-2] = '\n'; --i; }
-        break; }
+    char * end = run + size * ( i + 1 ) / nparts;
+    if( end <= p ) end = p;
+    else end = (char *)memchr( end - 1, '\n', run + size - end + 1 ) + 1;
+    parts[i].buf = p; parts[i].size = end - p;
+    parts[i].keep_last_cr = newline_added && end == run + size;
+    p = end;
     }
-  buf[i] = 0;
-  if( c == EOF )
+  if( nparts > 1 ) run_jobs( scan_part, parts, sizeof parts[0], nparts );
+  else scan_part( parts );
+  char * q = run;			/* join the parts stripped of CRs */
+  for( i = 0; i < nparts; ++i )
     {
-    if( ferror( fp ) )
+    if( parts[i].has_nul && !isbinary() ) set_binary();
+    if( q != parts[i].buf ) memmove( q, parts[i].buf, parts[i].size );
+    q += parts[i].size;
+    }
+  return q - run;
+  }
+
+
+/* size of the blocks of input text processed at a time */
+static int read_block_size( void )
+  { return ( jobs() > 1 ) ? jobs() << 22 : 1 << 20; }
+
+
+/* Return the next run of complete lines of a mapped file, starting at
+   position *posp, and advance *posp past it. The last line of the file
+   may lack a newline. Return 0 if error, or *sizep = 0 if EOF.
+*/
+static const char * next_mapped_run( const char * const map,
+                                     const long map_size, long * const posp,
+                                     long * const sizep,
+                                     bool * const newline_addedp )
+  {
+  const char * const p = map + *posp;
+  const long rest = map_size - *posp;
+  long size = min( rest, (long)read_block_size() );
+
+  *sizep = 0;
+  if( rest <= 0 ) return map;			/* EOF */
+  if( size < rest )				/* end run at a newline */
+    {
+    const char * const nl = (const char *)
+      memchr( p + size - 1, '\n', rest - size + 1 );
+    size = nl ? nl + 1 - p : rest;
+    }
+  if( size == rest && p[size-1] != '\n' ) *newline_addedp = true;
+  *posp += size; *sizep = size;
+  return p;
+  }
+
+
+/* Read a run of complete lines of text from a stream.
+   The stream is read in large blocks, and line boundaries are found with
+   memchr. Each run is scanned for NULs, and the CRs of its CR/LF pairs are
+   stripped in place, by scan_run.
+   Return pointer to buffer and size of the run (including the trailing
+   newline of the last line, which is added if it does not exist), or 0 if
+   error. *sizep = 0 if EOF.
+*/
+static const char * read_stream_lines( const char * const filename,
+                                       FILE * const fp, long * const sizep,
+                                       bool * const newline_addedp )
+  {
+  const long block_size = read_block_size();
+  bool eof = false;
+  long i;
+
+  *sizep = 0;
+  while( true )
+    {
+    i = rend;
+    while( i > rbegin && rbuf[i-1] != '\n' ) --i;	/* find last newline */
+    if( i > rbegin ) break;			/* return complete lines */
+    if( eof )
       {
-      show_strerror( filename, errno );
-      set_error_msg( "Cannot read input file" );
-      return 0;
+      if( rend <= rbegin ) { rbegin = rend = 0; return rbuf; }	/* EOF */
+      rbuf[rend++] = '\n'; *newline_addedp = true; i = rend;
+      break;
       }
-    else if( i )
+    if( rbegin > 0 )				/* read a block */
+      { memmove( rbuf, rbuf + rbegin, rend - rbegin );
+        rend -= rbegin; rbegin = 0; }
+    if( rend + block_size + 1 > rbufsz &&
+        !resize_buffer( &rbuf, &rbufsz, rend + block_size + 1 ) )
+      { rbegin = rend = 0; return 0; }
+    const long size = fread( rbuf + rend, 1, rbufsz - rend - 1, fp );
+    if( size < rbufsz - rend - 1 )
       {
-      buf[i] = '\n'; buf[i+1] = 0; *newline_addedp = true;
-      if( !isbinary() ) ++i;
+      if( ferror( fp ) )
+        {
+        show_strerror( filename, errno );
+        set_error_msg( "Cannot read input file" );
+        rbegin = rend = 0; return 0;
+        }
+      eof = true;
       }
+    rend += size;
     }
-  *sizep = i;
-  return buf;
+  char * const run = rbuf + rbegin;
+  const long size = i - rbegin;
+  rbegin = i;
+  disable_interrupts();
+  *sizep = scan_run( run, size, *newline_addedp );
+  enable_interrupts();
+  return run;
   }
 
 
@@ -238,36 +379,35 @@ static const char * read_stream_line( const char * const filename,
    Return number of bytes read, or -1 if error.
 */
 static long read_stream( const char * const filename, FILE * const fp,
-                         const int addr )
+                         const long addr )
   {
-  line_node * lp = search_line_node( addr );
   undo_atom * up = 0;
   long total_size = 0;		/* number of bytes read */
   const bool o_isbinary = isbinary();
   const bool appended = ( addr == last_addr() );
   const bool o_unterminated_last_line = unterminated_last_line();
   bool newline_added = false;
+  long map_size = 0, map_pos = 0;
+  const char * const map =
+    map_files() ? map_sbuf_file( fileno( fp ), &map_size ) : 0;
 
   set_current_addr( addr );
+  rbegin = rend = 0;
   while( true )
     {
-    int size = 0;
-    const char * const s =
-      read_stream_line( filename, fp, &size, &newline_added );
+    long size = 0;
+    const char * const s = map ?
+      next_mapped_run( map, map_size, &map_pos, &size, &newline_added ) :
+      read_stream_lines( filename, fp, &size, &newline_added );
     if( !s ) return -1;
     if( size <= 0 ) break;
-    total_size += size;
     disable_interrupts();
-    if( !put_sbuf_line( s, size + newline_added ) )
-      { enable_interrupts(); return -1; }
-    lp = lp->q_forw;
-    if( up ) up->tail = lp;
-    else
-      {
-      up = push_undo_atom( UADD, current_addr(), current_addr() );
-      if( !up ) { enable_interrupts(); return -1; }
-      }
+    const long n = map ? put_mapped_lines( s, size, &up ) :
+                         put_sbuf_lines( s, size, &up );
     enable_interrupts();
+    if( n < 0 ) return -1;
+    if( map ) size = n;		/* CRs stripped, missing newline counted */
+    total_size += size - ( newline_added && isbinary() );
     }
   if( !scripted() )
     { if( addr && appended && total_size && o_unterminated_last_line )
@@ -285,8 +425,8 @@ static long read_stream( const char * const filename, FILE * const fp,
 /* Read a named file/pipe into the buffer.
    Return line count, -1 if file not found, -2 if fatal error.
 */
-int read_file( const char * const filename, const int addr,
-               bool * const read_onlyp )
+long read_file( const char * const filename, const long addr,
+                bool * const read_onlyp )
   {
   FILE * fp;
   int ret;
@@ -309,47 +449,83 @@ int read_file( const char * const filename, const int addr,
   }
 
 
+/* write size bytes from buf to file descriptor fd; return false if error */
+static bool write_all( const int fd, const char * buf, long size )
+  {
+  while( size > 0 )
+    {
+    const long n = write( fd, buf, size );
+    if( n < 0 ) { if( errno == EINTR ) continue; return false; }
+    buf += n; size -= n;
+    }
+  return true;
+  }
+
+
 /* Write a range of lines to a stream.
+   The lines and their newlines are gathered in a large buffer, which is
+   written with write(2) each time it fills up, bypassing stdio. Lines are
+   read part by part, and parts larger than the buffer are written in
+   place, so that long lines are not copied.
    Return number of bytes written, or -1 if error.
 */
 static long write_stream( const char * const filename, FILE * const fp,
-                          int from, const int to )
+                          long from, const long to )
   {
+  enum { block_size = 1 << 20 };
+  static char * buf = 0;
+  static long bufsz = 0;
   line_node * lp = search_line_node( from );
+  const int fd = fileno( fp );
+  const bool unterminated = isbinary() && unterminated_last_line();
   long size = 0;		/* number of bytes written */
+  long i = 0;			/* number of bytes in buf */
 
+  if( !resize_buffer( &buf, &bufsz, block_size ) ) return -1;
   while( from && from <= to )
     {
-    int len;
-    char * p = get_sbuf_line( lp );
-    if( !p ) return -1;
-    len = lp->len;
-    if( from != last_addr() || !isbinary() || !unterminated_last_line() )
-      p[len++] = '\n';
-    size += len;
-    while( --len >= 0 )
-      if( fputc( *p++, fp ) == EOF )
-        {
-        show_strerror( filename, errno );
-        set_error_msg( "Cannot write file" );
-        return -1;
-        }
-    ++from; lp = lp->q_forw;
+    const long len = node_len( lp );
+    long off, n;
+    for( off = 0; off < len; off += n )
+      {
+      n = len - off;
+      const char * const p = get_sbuf_line_part( lp, off, &n );
+      if( !p ) return -1;
+      if( i > 0 && i + n > bufsz )
+        { if( !write_all( fd, buf, i ) ) goto error; size += i; i = 0; }
+      if( n >= bufsz )
+        { if( !write_all( fd, p, n ) ) goto error; size += n; continue; }
+      memcpy( buf + i, p, n ); i += n;
+      }
+    if( from != last_addr() || !unterminated )
+      {
+      if( i >= bufsz )
+        { if( !write_all( fd, buf, i ) ) goto error; size += i; i = 0; }
+      buf[i++] = '\n';
+      }
+    ++from; lp = next_line_node( lp );
     }
+  if( i > 0 && !write_all( fd, buf, i ) ) goto error;
+  size += i;
   return size;
+error:
+  show_strerror( filename, errno );
+  set_error_msg( "Cannot write file" );
+  return -1;
   }
 
 
 /* Write a range of lines to a named file/pipe.
    Return line count, or -1 if error.
 */
-int write_file( const char * const filename, const char * const mode,
-                const int from, const int to )
+long write_file( const char * const filename, const char * const mode,
+                 const long from, const long to )
   {
   FILE * fp;
   int ret;
 
   if( *filename == '!' ) fp = popen( filename + 1, "w" );
+  else if( !unmap_sbuf_files( filename ) ) return -1;
   else fp = fopen( filename, mode );
   if( !fp )
     { show_strerror( filename, errno );
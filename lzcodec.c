@@ -0,0 +1,149 @@
+/* lzcodec.c: LZ77 codec for the compressed scratch buffer of ed */
+/* GNU ed - The GNU line editor.
+   Copyright (C) 2006-2025 Antonio Diaz Diaz.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+   The compressed data is a sequence of packets. Each packet starts with a
+   token byte, whose high nibble is the number of literals and whose low
+   nibble is the length of the match minus min_match. A nibble of 15 is
+   followed by bytes of 255 and a final byte lesser than 255, all of which
+   are added to it. Then come the literals, and then the distance of the
+   match in two bytes, least significant first. The last packet has no
+   match; it ends at the end of the data.
+
+   Speed matters more than ratio here, so the compressor only looks for
+   matches at the last position seen with the same hash of 4 bytes, and
+   skips faster over data that does not compress.
+*/
+
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ed.h"
+
+
+enum { hash_bits = 14, min_match = 4, max_distance = 65535 };
+
+static uint32_t get32( const unsigned char * const p )
+  { uint32_t v; memcpy( &v, p, 4 ); return v; }
+
+static int hash4( const unsigned char * const p )
+  { return ( get32( p ) * 2654435761U ) >> ( 32 - hash_bits ); }
+
+
+/* store an extended length after a nibble of 15 */
+static unsigned char * put_length( unsigned char * d, long len )
+  {
+  for( ; len >= 255; len -= 255 ) *d++ = 255;
+  *d++ = len;
+  return d;
+  }
+
+
+/* Compress the size bytes at src into dst, of capacity cap bytes.
+   Return the compressed size, or 0 if it would not be smaller than cap. */
+long lz_compress( const char * const src, const long size, char * const dst,
+                  const long cap )
+  {
+  int table[1 << hash_bits];		/* last position of each hash */
+  const unsigned char * const s = (const unsigned char *)src;
+  unsigned char * d = (unsigned char *)dst;
+  const unsigned char * const dend = d + cap;
+  long anchor = 0;			/* first literal not yet stored */
+  long i = 0, misses = 0;
+
+  memset( table, 0xFF, sizeof table );
+  while( i + min_match <= size )
+    {
+    const int h = hash4( s + i );
+    const long j = table[h];
+    table[h] = i;
+    if( j < 0 || i - j > max_distance || get32( s + j ) != get32( s + i ) )
+      { i += 1 + ( misses++ >> 6 ); continue; }	/* skip faster */
+    long len = min_match;
+    while( i + len < size && s[j+len] == s[i+len] ) ++len;
+    const long lits = i - anchor;
+    /* token, lengths, literals and distance */
+    if( d + 1 + lits / 255 + 1 + lits + 2 + len / 255 + 1 >= dend ) return 0;
+    unsigned char * const token = d++;
+    *token = ( min( lits, 15L ) << 4 ) | min( len - min_match, 15L );
+    if( lits >= 15 ) d = put_length( d, lits - 15 );
+    memcpy( d, s + anchor, lits ); d += lits;
+    *d++ = ( i - j ) & 0xFF; *d++ = ( i - j ) >> 8;
+    if( len - min_match >= 15 ) d = put_length( d, len - min_match - 15 );
+    i += len; anchor = i; misses = 0;
+    }
+  const long lits = size - anchor;		/* last packet */
+  if( d + 1 + lits / 255 + 1 + lits >= dend ) return 0;
+  *d++ = min( lits, 15L ) << 4;
+  if( lits >= 15 ) d = put_length( d, lits - 15 );
+  memcpy( d, s + anchor, lits ); d += lits;
+  return d - (unsigned char *)dst;
+  }
+
+
+/* read an extended length; return -1 if the data ends */
+static long get_length( const unsigned char ** const pp,
+                        const unsigned char * const pend )
+  {
+  long len = 0;
+  while( *pp < pend )
+    { const unsigned char c = *(*pp)++; len += c; if( c < 255 ) return len; }
+  return -1;
+  }
+
+
+/* Decompress the size bytes at src into dst, of capacity cap bytes.
+   Return the decompressed size, or -1 if the data is corrupt. */
+long lz_decompress( const char * const src, const long size, char * const dst,
+                    const long cap )
+  {
+  const unsigned char * p = (const unsigned char *)src;
+  const unsigned char * const pend = p + size;
+  unsigned char * d = (unsigned char *)dst;
+  unsigned char * const dend = d + cap;
+
+  while( p < pend )
+    {
+    const int token = *p++;
+    long lits = token >> 4;
+    if( lits == 15 )
+      { const long n = get_length( &p, pend ); if( n < 0 ) return -1;
+        lits += n; }
+    if( lits > pend - p || lits > dend - d ) return -1;
+    if( lits <= 16 && pend - p >= 16 && dend - d >= 16 )
+      memcpy( d, p, 16 );		/* fixed size copy is faster */
+    else memcpy( d, p, lits );
+    d += lits; p += lits;
+    if( p >= pend ) break;			/* last packet */
+    if( pend - p < 2 ) return -1;
+    const long dist = p[0] | ( p[1] << 8 ); p += 2;
+    long len = ( token & 15 ) + min_match;
+    if( ( token & 15 ) == 15 )
+      { const long n = get_length( &p, pend ); if( n < 0 ) return -1;
+        len += n; }
+    if( dist == 0 || dist > d - (unsigned char *)dst || len > dend - d )
+      return -1;
+    const unsigned char * m = d - dist;
+    if( dist >= 8 && dend - d >= len + 8 )	/* copy 8 bytes at a time */
+      { unsigned char * const e = d + len;
+        do { memcpy( d, m, 8 ); d += 8; m += 8; } while( d < e );
+        d = e; }
+    else while( len-- > 0 ) *d++ = *m++;	/* overlapping copy */
+    }
+  return d - (unsigned char *)dst;
+  }
@@ -50,18 +50,29 @@ static const char * const program_name = "ed";
 static const char * const program_year = "2025";
 static const char * invocation_name = "ed";		/* default value */
 
+static bool dedup_lines_ = false;	/* store identical lines once */
 static bool extended_regexp_ = false;	/* use EREs */
+static bool index_file_ = false;	/* keep line index in a file */
+static int jobs_ = 1;			/* number of worker threads */
+static bool map_files_ = false;		/* reference text of files read */
 static bool quiet = false;		/* suppress diagnostics */
 static bool restricted_ = false;	/* run in restricted mode */
 static bool safe_names = true;		/* reject control chars in file names */
 static bool scripted_ = false;		/* suppress byte counts and ! prompt */
+static bool stats = false;		/* print statistics at exit */
 static bool strip_cr_ = false;		/* strip trailing CRs */
+static long scratch_mem_ = 16 << 20;	/* max size of in-memory scratch */
 static bool traditional_ = false;	/* be backwards compatible */
 
 /* Access functions for command-line flags. */
+bool dedup_lines( void ) { return dedup_lines_; }
 bool extended_regexp( void ) { return extended_regexp_; }
+bool index_file( void ) { return index_file_; }
+int jobs( void ) { return jobs_; }
+bool map_files( void ) { return map_files_; }
 bool restricted( void ) { return restricted_; }
 bool scripted( void ) { return scripted_; }
+long scratch_mem( void ) { return scratch_mem_; }
 bool strip_cr( void ) { return strip_cr_; }
 bool traditional( void ) { return traditional_; }
 
@@ -91,6 +102,13 @@ static void show_help( void )
           "  -r, --restricted           run in restricted mode\n"
           "  -s, --script               suppress byte counts and '!' prompt\n"
           "  -v, --verbose              be verbose; equivalent to the 'H' command\n"
+          "      --dedup-lines          store identical lines only once\n"
+          "      --index-file           keep the line index in a temporary file\n"
+          "      --jobs=N               use N threads to load, search, and substitute [1]\n"
+          "      --map-files            reference the text of files read, don't copy it\n"
+          "      --scratch=TYPE         store text in memory, mmap, file, or compressed\n"
+          "      --scratch-mem=SIZE     keep up to SIZE bytes of text in memory [16M]\n"
+          "      --stats                print memory statistics to stderr at exit\n"
           "      --strip-trailing-cr    strip carriage returns at end of text lines\n"
           "      --unsafe-names         allow control characters in file names\n"
           "\nStart edit by reading in 'file' if given.\n"
@@ -156,6 +174,13 @@ void show_strerror( const char * const filename, const int errcode )
   }
 
 
+static void show_stats( void )
+  {
+  print_buffer_stats();
+  print_regex_stats();
+  }
+
+
 static void show_error( const char * const msg, const int errcode, const bool help )
   {
   if( msg && msg[0] )
@@ -168,12 +193,60 @@ static void show_error( const char * const msg, const int errcode, const bool he
   }
 
 
-static int parse_addr( const char * const arg )
+/* Parse a size in bytes, optionally followed by a multiplier suffix
+   'k', 'M', or 'G' (powers of 1024). */
+static long parse_size( const char * const arg )
+  {
+  char * tail;
+  errno = 0;
+  long tmp = strtol( arg, &tail, 10 );
+  if( errno == 0 && tail != arg && tmp >= 0 )
+    {
+    int shift = 0;
+    switch( *tail )
+      {
+      case 'G': shift += 10;		/* fall through */
+      case 'M': shift += 10;		/* fall through */
+      case 'k': shift += 10; ++tail;
+      }
+    if( !*tail && tmp <= LONG_MAX >> shift ) return tmp << shift;
+    }
+  if( !quiet )
+    fprintf( stderr, "%s: %s: Invalid size.\n", program_name, arg );
+  exit( 1 );
+  }
+
+
+static int parse_jobs( const char * const arg )
+  {
+  char * tail;
+  errno = 0;
+  const long tmp = strtol( arg, &tail, 10 );
+  if( errno == 0 && tail != arg && !*tail && tmp >= 1 && tmp <= max_jobs )
+    return tmp;
+  if( !quiet )
+    fprintf( stderr, "%s: %s: Invalid number of jobs; must be 1 to %d.\n",
+             program_name, arg, max_jobs );
+  exit( 1 );
+  }
+
+
+static void parse_scratch( const char * const arg )
+  {
+  if( set_scratch_backend( arg ) ) return;
+  if( !quiet )
+    fprintf( stderr, "%s: %s: Invalid scratch type; must be memory, mmap, "
+             "file, or compressed.\n", program_name, arg );
+  exit( 1 );
+  }
+
+
+static long parse_addr( const char * const arg )
   {
   char * tail;
   errno = 0;
   const long tmp = strtol( arg, &tail, 10 );
-  if( errno == 0 && tail != arg && tmp >= 1 && tmp <= INT_MAX ) return tmp;
+  if( errno == 0 && tail != arg && tmp >= 1 && tmp <= max_lines ) return tmp;
   if( !quiet )
     fprintf( stderr, "%s: %s: Invalid line number; must be >= 1.\n",
              program_name, arg );
@@ -219,7 +292,8 @@ int main( const int argc, const char * const argv[] )
   {
   bool initial_error = false;		/* fatal error reading file */
   bool loose = false;
-  enum { opt_cr = 256, opt_un };
+  enum { opt_cr = 256, opt_dl, opt_if, opt_jo, opt_mf, opt_sc, opt_sm, opt_st,
+         opt_un };
   const ap_Option options[] =
     {
     { 'E', "extended-regexp",      ap_no  },
@@ -234,6 +308,13 @@ int main( const int argc, const char * const argv[] )
     { 'v', "verbose",              ap_no  },
     { 'V', "version",              ap_no  },
     { opt_cr, "strip-trailing-cr", ap_no  },
+    { opt_dl, "dedup-lines",       ap_no  },
+    { opt_if, "index-file",        ap_no  },
+    { opt_jo, "jobs",              ap_yes },
+    { opt_mf, "map-files",         ap_no  },
+    { opt_sc, "scratch",           ap_yes },
+    { opt_sm, "scratch-mem",       ap_yes },
+    { opt_st, "stats",             ap_no  },
     { opt_un, "unsafe-names",      ap_no  },
     { 0, 0,                        ap_no  } };
 
@@ -264,6 +345,13 @@ int main( const int argc, const char * const argv[] )
       case 'v': set_verbose(); break;
       case 'V': show_version(); return 0;
       case opt_cr: strip_cr_ = true; break;
+      case opt_dl: dedup_lines_ = true; break;
+      case opt_if: index_file_ = true; break;
+      case opt_jo: jobs_ = parse_jobs( arg ); break;
+      case opt_mf: map_files_ = true; break;
+      case opt_sc: parse_scratch( arg ); break;
+      case opt_sm: scratch_mem_ = parse_size( arg ); break;
+      case opt_st: stats = true; break;
       case opt_un: safe_names = false; break;
       default: show_error( "internal error: uncaught option.", 0, false );
                return 3;
@@ -271,10 +359,11 @@ int main( const int argc, const char * const argv[] )
     } /* end process options */
 
   setlocale( LC_ALL, "" );
+  if( stats ) atexit( show_stats );
   if( !init_buffers() ) return 1;
 
   const char * start_re_arg = 0;		/* '+/RE' or '+?RE' */
-  int start_addr = 0;				/* '+line' */
+  long start_addr = 0;				/* '+line' */
   for( ; argind < ap_arguments( &parser ); ++argind )
     {
     const char * const arg = ap_argument( &parser, argind );
@@ -293,7 +382,7 @@ int main( const int argc, const char * const argv[] )
       {
       if( arg[0] != '!' && !set_def_filename( arg ) ) return 1;
       /* first e can't be undone because u_current_addr = u_last_addr = -1 */
-      const int ret = first_e_command( arg );	/* line count, < 0 if error */
+      const long ret = first_e_command( arg );	/* line count, < 0 if error */
       if( ret < 0 && !interactive() ) return 2;
       if( ret == -2 ) initial_error = true;
       if( ret > 0 && start_addr > 0 )
@@ -302,7 +391,7 @@ int main( const int argc, const char * const argv[] )
         {
         set_current_addr( 0 );		/* start searching from address 0 */
         const char * p = start_re_arg + 1;
-        const int addr = next_matching_node_addr( &p );
+        const long addr = next_matching_node_addr( &p );
         if( addr > 0 && addr <= last_addr() ) set_current_addr( addr );
         else
           {
@@ -37,13 +37,13 @@ static const char * const no_prev_com = "No previous command";
 static const char * def_filename = "";	/* default filename */
 static char errmsg[80] = "";		/* error message buffer */
 static const char * prompt_str = "*";	/* command prompt */
-static int first_addr = 0, second_addr = 0;
+static long first_addr = 0, second_addr = 0;
 static bool prompt_on = false;		/* show command prompt */
 static bool read_only = false;		/* loaded file is not writable */
 static bool verbose = false;		/* print all error messages */
 
 
-int first_e_command( const char * const filename )
+long first_e_command( const char * const filename )
   { return read_file( filename, 0, &read_only ); }
 
 void invalid_address( void ) { set_error_msg( "Invalid address" ); }
@@ -51,7 +51,7 @@ void invalid_address( void ) { set_error_msg( "Invalid address" ); }
 bool set_def_filename( const char * const s )
   {
   static char * buf = 0;		/* filename buffer */
-  static int bufsz = 0;			/* filename buffer size */
+  static long bufsz = 0;			/* filename buffer size */
   const int len = strlen( s );
 
   if( !resize_buffer( &buf, &bufsz, len + 1 ) ) return false;
@@ -72,7 +72,7 @@ void set_error_msg( const char * const msg )
 bool set_prompt( const char * const s )
   {
   static char * buf = 0;		/* prompt buffer */
-  static int bufsz = 0;			/* prompt buffer size */
+  static long bufsz = 0;			/* prompt buffer size */
   const int len = strlen( s );
 
   if( !resize_buffer( &buf, &bufsz, len + 1 ) ) return false;
@@ -108,7 +108,7 @@ void unmark_line_node( const line_node * const lp )
 
 
 /* return address of a marked line */
-static int get_marked_node_addr( int c )
+static long get_marked_node_addr( int c )
   {
   c -= 'a';
   if( c < 0 || c >= 26 ) { set_error_msg( inv_mark_ch ); return -1; }
@@ -120,11 +120,11 @@ static int get_marked_node_addr( int c )
 static const char * get_shell_command( const char ** const ibufpp )
   {
   static char * buf = 0;		/* temporary buffer */
-  static int bufsz = 0;
+  static long bufsz = 0;
   static char * shcmd = 0;		/* shell command buffer */
-  static int shcmdsz = 0;		/* shell command buffer size */
-  static int shcmdlen = 0;		/* shell command length */
-  int i = 0, len = 0;
+  static long shcmdsz = 0;		/* shell command buffer size */
+  static long shcmdlen = 0;		/* shell command length */
+  long i = 0, len = 0;
   bool replacement = false;		/* true if '!' or '%' are replaced */
 
   if( restricted() ) { set_error_msg( "Shell access restricted" ); return 0; }
@@ -178,7 +178,7 @@ static const char * get_filename( const char ** const ibufpp,
                                   const bool traditional_f_command )
   {
   static char * buf = 0;
-  static int bufsz = 0;
+  static long bufsz = 0;
 
   skip_blanks( ibufpp );
   if( **ibufpp == '\n' )
@@ -188,7 +188,7 @@ static const char * get_filename( const char ** const ibufpp,
     ++*ibufpp; return "";			/* skip newline for global */
     }
   const char * hd = 0;
-  int hdsize = 0, size = 0;
+  long hdsize = 0, size = 0;
   if( !get_extended_line( ibufpp, &size, true ) ) return 0;
   if( **ibufpp == '!' ) { ++*ibufpp; return get_shell_command( ibufpp ); }
   if( **ibufpp == '~' && (*ibufpp)[1] == '/' )
@@ -198,7 +198,7 @@ static const char * get_filename( const char ** const ibufpp,
     { set_error_msg( "Filename too long" ); return 0; }
   if( !resize_buffer( &buf, &bufsz, hdsize + size + 1 ) ) return 0;
   if( hdsize > 0 ) memcpy( buf, hd, hdsize );
-  int i;
+  long i;
   for( i = hdsize; i < hdsize + size && **ibufpp != '\n'; ++i, ++*ibufpp )
     buf[i] = **ibufpp;
   buf[i] = 0;
@@ -207,8 +207,9 @@ static const char * get_filename( const char ** const ibufpp,
   }
 
 
-/* convert a string to int with out_of_range detection */
-static bool parse_int( int * const i, const char ** const ibufpp )
+/* convert a string to long in the range [-limit, limit] */
+static bool parse_long( long * const lp, const char ** const ibufpp,
+                        const long limit )
   {
   char * tail;
   errno = 0;
@@ -216,9 +217,19 @@ static bool parse_int( int * const i, const char ** const ibufpp )
 
   if( tail == *ibufpp )
     { set_error_msg( "Invalid number" ); return false; }
-  if( errno == ERANGE || li > INT_MAX || li < -INT_MAX )
+  if( errno == ERANGE || li > limit || li < -limit )
     { set_error_msg( "Number out of range" ); return false; }
   *ibufpp = tail;
+  *lp = li;
+  return true;
+  }
+
+
+/* convert a string to int with out_of_range detection */
+static bool parse_int( int * const i, const char ** const ibufpp )
+  {
+  long li;
+  if( !parse_long( &li, ibufpp, INT_MAX ) ) return false;
   *i = li;
   return true;
   }
@@ -238,11 +249,11 @@ static int extract_addresses( const char ** const ibufpp )
 
   while( true )
     {
-    int n;
+    long n;
     const unsigned char ch = **ibufpp;
     if( isdigit( ch ) )
       {
-      if( !parse_int( &n, ibufpp ) ) return -1;
+      if( !parse_long( &n, ibufpp, max_lines ) ) return -1;
       if( first ) { first = false; second_addr = n; } else second_addr += n;
       }
     else switch( ch )
@@ -253,7 +264,7 @@ static int extract_addresses( const char ** const ibufpp )
       case '-': if( first ) { first = false; second_addr = current_addr(); }
                 if( isdigit( (unsigned char)(*ibufpp)[1] ) )
                   {
-                  if( !parse_int( &n, ibufpp ) ) return -1;
+                  if( !parse_long( &n, ibufpp, max_lines ) ) return -1;
                   second_addr += n;
                   }
                 else { ++*ibufpp;
@@ -308,10 +319,10 @@ static int extract_addresses( const char ** const ibufpp )
 
 
 /* get a valid address from the command buffer */
-static bool get_third_addr( const char ** const ibufpp, int * const addr )
+static bool get_third_addr( const char ** const ibufpp, long * const addr )
   {
-  const int old1 = first_addr;
-  const int old2 = second_addr;
+  const long old1 = first_addr;
+  const long old2 = second_addr;
   int addr_cnt = extract_addresses( ibufpp );
 
   if( addr_cnt < 0 ) return false;
@@ -326,7 +337,7 @@ static bool get_third_addr( const char ** const ibufpp, int * const addr )
 
 
 /* set default range and return true if address range is valid */
-static bool set_addr_range( const int n, const int m, const int addr_cnt )
+static bool set_addr_range( const long n, const long m, const int addr_cnt )
   {
   if( addr_cnt == 0 ) { first_addr = n; second_addr = m; }
   if( first_addr < 1 || first_addr > second_addr || second_addr > last_addr() )
@@ -341,7 +352,7 @@ static bool set_addr_range2( const int addr_cnt )
   }
 
 /* set default second_addr and return true if second_addr is valid */
-static bool set_second_addr( const int addr, const int addr_cnt )
+static bool set_second_addr( const long addr, const int addr_cnt )
   {
   if( addr_cnt == 0 ) second_addr = addr;
   if( second_addr < 1 || second_addr > last_addr() )
@@ -492,7 +503,7 @@ static bool command_s( const char ** const ibufpp, int * const pflagsp,
 static const char * get_tmpname( const bool init )
   {
   static char * buf = 0;
-  static int bufsz = 0;
+  static long bufsz = 0;
   if( !buf && init )
     {
     enum { num_codes = 36 };
@@ -540,7 +551,7 @@ static bool command_shell( const char ** const ibufpp, const int addr_cnt,
   if( !isglobal ) clear_undo_stack();
   if( !delete_lines( first_addr, second_addr, isglobal ) )
     { remove( tmpname ); return false; }
-  const int line_count =
+  const long line_count =
     read_file( tmpname, current_addr() - ( current_addr() >= first_addr ), 0 );
   if( current_addr() <= 0 && last_addr() > 0 ) set_current_addr( 1 );
   remove( tmpname );
@@ -556,7 +567,8 @@ static int exec_command( const char ** const ibufpp, const bool isglobal )
   {
   const char * fnp;				/* filename */
   int pflags = 0;				/* print suffixes */
-  int addr, c, n;
+  long addr;
+  int c, n;
   const int addr_cnt = extract_addresses( ibufpp );
 
   if( addr_cnt < 0 ) return ERR;
@@ -577,6 +589,10 @@ static int exec_command( const char ** const ibufpp, const bool isglobal )
                                  current_addr() >= first_addr, isglobal ) )
                 return ERR;
               break;
+    case 'C': if( unexpected_address( addr_cnt ) ||
+                  !get_command_suffix( ibufpp, &pflags ) ||
+                  !compact_sbuf( true ) ) return ERR;
+              break;
     case 'd': if( !set_addr_range2( addr_cnt ) ||
                   !get_command_suffix( ibufpp, &pflags ) ) return ERR;
               if( !isglobal ) clear_undo_stack();
@@ -732,7 +748,7 @@ pflabel:      if( !set_addr_range2( addr_cnt ) ||
               pflags = 0;
               break;
     case '=': if( !get_command_suffix( ibufpp, &pflags ) ) return ERR;
-              printf( "%d\n", addr_cnt ? second_addr : last_addr() );
+              printf( "%ld\n", addr_cnt ? second_addr : last_addr() );
               break;
     case '!': if( !command_shell( ibufpp, addr_cnt, isglobal ) ) return ERR;
               break;
@@ -756,7 +772,7 @@ static int exec_global( const char ** const ibufpp, const int pflags,
                         const bool interactive )
   {
   static char * buf = 0;
-  static int bufsz = 0;
+  static long bufsz = 0;
   const char * cmd = 0;
 
   if( !interactive )
@@ -779,7 +795,7 @@ static int exec_global( const char ** const ibufpp, const int pflags,
     if( interactive )
       {
       /* print current_addr; get a command in global syntax */
-      int len = 0;
+      long len = 0;
       if( !print_lines( current_addr(), current_addr(), pflags ) ) return ERR;
       *ibufpp = get_stdin_line( &len );
       if( !*ibufpp ) return ERR;			/* error */
@@ -811,7 +827,8 @@ int main_loop( const bool initial_error, const bool loose )
   extern jmp_buf jmp_state;
   const char * ibufp;			/* pointer to command buffer */
   volatile int err_status = 0;		/* program exit status */
-  int len = 0, status;
+  long len = 0;
+  int status;
 
   disable_interrupts();
   set_signals();
@@ -837,6 +854,13 @@ int main_loop( const bool initial_error, const bool loose )
     if( status == 0 )
       { if( read_only && modified() ) { read_only = false;
           show_warning( def_filename, "warning: read-only file" ); }
+        /* compact if there is enough dead text. A failure does not undo
+           the command, but is reported like an error */
+        if( !compact_sbuf( false ) )
+          { fputs( "?\n", stdout );
+            if( !loose && err_status == 0 ) err_status = 1;
+            set_warned( false );
+            if( verbose ) printf( "%s\n", errmsg ); }
         continue; }
     if( status == QUIT ) return err_status;
     fputs( "?\n", stdout );			/* give warning */
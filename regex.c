@@ -17,8 +17,14 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <ctype.h>
+#include <langinfo.h>
+#include <limits.h>
 #include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <wctype.h>
 
 #include "ed.h"
 
@@ -28,19 +34,70 @@ static const char * const inv_pat_del = "Invalid pattern delimiter";
 static const char * const mis_pat_del = "Missing pattern delimiter";
 static const char * const no_match    = "No match";
 static const char * const no_prev_pat = "No previous pattern";
-static regex_t * last_regexp = 0;	/* pointer to last regex found */
-static regex_t * subst_regexp = 0;	/* regex of last substitution */
+#ifndef REG_STARTEND
+#define REG_STARTEND 0			/* lines are matched in a copy */
+#endif
+
+/* A regex that is a string of ordinary characters, optionally anchored at
+   the beginning or end of line, is matched by searching the string with
+   the Boyer-Moore-Horspool algorithm instead of calling regexec. Else, if
+   the regex requires a string, lines not containing it are rejected with
+   the same search before calling regexec. */
+typedef struct
+  {
+  char * text;			/* the string, or 0 if none */
+  long len;
+  long bufsz;
+  bool exact;			/* the string is the whole regex */
+  bool bol;			/* anchored by '^' */
+  bool eol;			/* anchored by '$' */
+  bool icase;			/* compare folded characters */
+  unsigned char fold[UCHAR_MAX+1];	/* case folding table if icase */
+  long skip[UCHAR_MAX+1];	/* shift for the last character compared */
+  }
+Literal;
+
+/* Compiled regexes are kept in a cache, so that scripts alternating among
+   many patterns don't compile them again. The least recently used entry
+   is reused when the cache is full, except those of last_regexp and
+   subst_regexp. */
+enum { regex_cache_size = 64 };
+typedef struct
+  {
+  regex_t re;
+  char * pat;			/* source of the regex */
+  long patsz;
+  long patlen;
+  int cflags;
+  bool compiled;		/* re, pat, cflags and lit are valid */
+  long used;			/* time of last use, for LRU */
+  Literal lit;			/* string matched without regexec, if any */
+  }
+Regex_entry;
+static Regex_entry regex_cache[regex_cache_size];
+static long cache_clock = 0;
+static long cache_hits = 0, cache_misses = 0;
+static Regex_entry * last_regexp = 0;	/* pointer to last regex found */
+static Regex_entry * subst_regexp = 0;	/* regex of last substitution */
+
+typedef struct
+  {
+  long lines;			/* lines searched for a required string */
+  long rejects;			/* lines rejected without regexec */
+  }
+Prefilter_stats;
+static Prefilter_stats prefilter_stats = { 0, 0 };
 
 static char * rbuf = 0;			/* replacement buffer */
-static int rbufsz = 0;			/* replacement buffer size */
-static int rlen = 0;			/* replacement length */
+static long rbufsz = 0;			/* replacement buffer size */
+static long rlen = 0;			/* replacement length */
 
 
 bool subst_regex( void ) { return subst_regexp != 0; }
 
 
 /* translate characters in a string */
-static void translit_text( char * p, int len, const char from, const char to )
+static void translit_text( char * p, long len, const char from, const char to )
   {
   while( --len >= 0 )
     {
@@ -51,11 +108,11 @@ static void translit_text( char * p, int len, const char from, const char to )
 
 
 /* overwrite newlines with ASCII NULs */
-static void newline_to_nul( char * const s, const int len )
+static void newline_to_nul( char * const s, const long len )
   { translit_text( s, len, '\n', '\0' ); }
 
 /* overwrite ASCII NULs with newlines */
-static void nul_to_newline( char * const s, const int len )
+static void nul_to_newline( char * const s, const long len )
   { translit_text( s, len, '\0', '\n' ); }
 
 
@@ -84,9 +141,9 @@ static const char * parse_char_class( const char * p )
 static char * extract_pattern( const char ** const ibufpp, const char delimiter )
   {
   static char * buf = 0;
-  static int bufsz = 0;
+  static long bufsz = 0;
   const char * nd = *ibufpp;
-  int len;
+  long len;
 
   while( *nd != delimiter && !islf_or_nul( *nd ) )
     {
@@ -109,37 +166,214 @@ static char * extract_pattern( const char ** const ibufpp, const char delimiter
   }
 
 
-/* Return pointer to compiled regex (last_regexp), different from subst_regexp.
-   Return 0 if error.
-*/
-static regex_t * compile_regex( const char * const pat, const bool ignore_case )
+/* In a multibyte locale, return true if the ASCII letter c, ignoring case,
+   only matches its two cases. Some letters also match other characters;
+   for example 'k' matches the Kelvin sign. */
+static bool icase_letter_ok( const unsigned char c )
   {
-  static regex_t store[3];		/* space for three compiled regexes */
-  regex_t * exp;
-  int n;
+  static bool init = false;
+  static bool bad[128];			/* indexed by lowercase letter */
 
-  for( n = 0; n < 3; ++n )
-    if( ( exp = &store[n] ) != last_regexp && exp != subst_regexp ) break;
+  if( !init )
+    {
+    wint_t w;
+    for( w = 128; w <= 0x10FFFF; ++w )
+      {
+      const wint_t u = towupper( w ), l = towlower( w );
+      if( u < 128 ) bad[tolower( u )] = true;
+      if( l < 128 ) bad[tolower( l )] = true;
+      }
+    for( w = 'a'; w <= 'z'; ++w )
+      if( towupper( w ) != (wint_t)toupper( w ) ||
+          towlower( toupper( w ) ) != w || tolower( toupper( w ) ) != (int)w )
+        bad[w] = true;
+    init = true;
+    }
+  return !bad[tolower( c )];
+  }
+
+
+/* Fold the string of a literal if icase and set up its tables. */
+static void set_literal_tables( Literal * const lp )
+  {
+  unsigned char * const t = (unsigned char *)lp->text;
+  int i;
+
+  for( i = 0; i <= UCHAR_MAX; ++i )
+    lp->fold[i] = lp->icase ? tolower( i ) : i;
+  for( i = 0; i < lp->len; ++i ) t[i] = lp->fold[t[i]];
+  for( i = 0; i <= UCHAR_MAX; ++i ) lp->skip[i] = lp->len;
+  for( i = 0; i + 1 < lp->len; ++i ) lp->skip[t[i]] = lp->len - 1 - i;
+  if( lp->icase )		/* both cases of a character shift the same */
+    for( i = 0; i <= UCHAR_MAX; ++i ) lp->skip[i] = lp->skip[lp->fold[i]];
+  }
+
+
+/* Return true if the text of pat, after the optional '^', is a string of
+   ordinary characters, optionally followed by '$', that regcomp would
+   match byte by byte. In multibyte locales only ASCII characters in UTF-8
+   are accepted, which can't be part of other characters, and only letters
+   that match no other characters if ignore_case. Store the string in *lp. */
+static bool parse_literal( const char * p, const bool ignore_case,
+                           Literal * const lp )
+  {
+  const char * const specials =
+    extended_regexp() ? ".[\\()*+?{|^$" : ".[\\*^$";
+  const bool mb = MB_CUR_MAX > 1;
+
+  if( mb && strcmp( nl_langinfo( CODESET ), "UTF-8" ) != 0 ) return false;
+  if( !resize_buffer( &lp->text, &lp->bufsz, strlen( p ) + 1 ) )
+    return false;
+  lp->len = 0; lp->bol = lp->eol = false; lp->icase = ignore_case;
+  if( *p == '^' ) { lp->bol = true; ++p; }
+  while( *p )
+    {
+    unsigned char c = *p++;
+    if( c == '$' && !*p ) { lp->eol = true; break; }
+    if( c == '\\' )
+      { c = *p++; if( !c || !strchr( ".[]\\*^$/", c ) ) return false; }
+    else if( strchr( specials, c ) ) return false;
+    if( mb && ( c > 127 ||
+                ( ignore_case && isalpha( c ) && !icase_letter_ok( c ) ) ) )
+      return false;
+    lp->text[lp->len++] = c;
+    }
+  lp->exact = true;
+  set_literal_tables( lp );
+  return true;
+  }
+
+
+/* Return true if the ASCII character c may be part of a required string
+   in the current locale. */
+static bool factor_char_ok( const unsigned char c, const bool ignore_case )
+  {
+  if( MB_CUR_MAX <= 1 ) return true;
+  return c <= 127 && ( !ignore_case || !isalpha( c ) || icase_letter_ok( c ) );
+  }
+
+
+/* Store in *lp the longest string of ordinary characters that any text
+   matched by pat must contain. Only characters outside of groups are
+   considered, and none if pat has alternatives. Return false if there is
+   no such string. Called only if parse_literal fails. */
+static bool parse_factor( const char * p, const bool ignore_case,
+                          Literal * const lp )
+  {
+  const bool ere = extended_regexp();
+  long start = 0;			/* start of current run in lp->text */
+  long best = 0, bestlen = 0;
+  int depth = 0;			/* nesting level of groups */
+
+  if( MB_CUR_MAX > 1 && strcmp( nl_langinfo( CODESET ), "UTF-8" ) != 0 )
+    return false;
+  if( !resize_buffer( &lp->text, &lp->bufsz, strlen( p ) + 1 ) )
+    return false;
+  lp->len = 0;
+  while( true )
+    {
+    unsigned char c = *p++;
+    bool ordinary = false, quantifier = false, interval = false;
+    if( c == '\\' )
+      {
+      c = *p++;
+      if( c == 0 || c == '|' ) return false;
+      if( strchr( ".[]\\*^$/", c ) ) ordinary = true;
+      else if( !ere )
+        {
+        if( c == '(' ) ++depth;
+        else if( c == ')' ) --depth;
+        else if( c == '+' || c == '?' ) quantifier = true;
+        else if( c == '{' ) quantifier = interval = true;
+        }
+      }
+    else if( c == '[' )
+      { p = parse_char_class( p ); if( !p ) return false; ++p; }
+    else if( c == '*' ) quantifier = true;
+    else if( ere && c == '|' ) return false;
+    else if( ere && c == '(' ) ++depth;
+    else if( ere && c == ')' ) --depth;
+    else if( ere && ( c == '+' || c == '?' ) ) quantifier = true;
+    else if( ere && c == '{' ) quantifier = interval = true;
+    else if( c && c != '.' && c != '^' && c != '$' ) ordinary = true;
+    if( ordinary && depth == 0 && factor_char_ok( c, ignore_case ) )
+      { lp->text[lp->len++] = c; continue; }
+    /* the last character of the run is the operand of the quantifier */
+    if( quantifier && lp->len > start ) --lp->len;
+    if( lp->len - start > bestlen )
+      { best = start; bestlen = lp->len - start; }
+    start = lp->len;
+    if( interval ) { p = strchr( p, '}' ); if( !p ) return false; ++p; }
+    if( c == 0 ) break;
+    }
+  if( bestlen <= 0 ) return false;
+  memmove( lp->text, lp->text + best, bestlen );
+  lp->len = bestlen; lp->exact = lp->bol = lp->eol = false;
+  lp->icase = ignore_case;
+  set_literal_tables( lp );
+  return true;
+  }
+
+
+/* Return the cache entry of pat compiled with the current flags, and make
+   it last_regexp. If pat is not in the cache, compile it in the least
+   recently used entry other than those of last_regexp and subst_regexp.
+   Return 0 if error. */
+static Regex_entry * compile_regex( const char * const pat,
+                                    const bool ignore_case )
+  {
   const int cflags = ( extended_regexp() ? REG_EXTENDED : 0 ) |
                      ( ignore_case ? REG_ICASE : 0 );
-  n = regcomp( exp, pat, cflags );
+  const long len = strlen( pat );
+  Regex_entry * ep = 0;			/* entry to reuse */
+  int i;
+
+  for( i = 0; i < regex_cache_size; ++i )
+    {
+    Regex_entry * const p = &regex_cache[i];
+    if( p->compiled && p->patlen == len && p->cflags == cflags &&
+        memcmp( p->pat, pat, len ) == 0 )
+      { ++cache_hits; p->used = ++cache_clock; return last_regexp = p; }
+    if( p != last_regexp && p != subst_regexp &&
+        ( !ep || ( ep->compiled && ( !p->compiled || p->used < ep->used ) ) ) )
+      ep = p;
+    }
+  ++cache_misses;
+  if( ep->compiled ) { ep->compiled = false; regfree( &ep->re ); }
+  /* keep the source to compile copies of the regex for worker threads */
+  if( !resize_buffer( &ep->pat, &ep->patsz, len + 1 ) ) return 0;
+  const int n = regcomp( &ep->re, pat, cflags );
   if( n )
     {
     char buf[80];
-    regerror( n, last_regexp, buf, sizeof buf );
+    regerror( n, &ep->re, buf, sizeof buf );
     set_error_msg( buf );
     return 0;
     }
-  /* free last_regexp if compiled and different from subst_regexp */
-  if( last_regexp && last_regexp != subst_regexp ) regfree( last_regexp );
-  last_regexp = exp;
-  return last_regexp;
+  memcpy( ep->pat, pat, len + 1 ); ep->patlen = len; ep->cflags = cflags;
+  Literal * const lp = &ep->lit;
+  if( !parse_literal( pat, ignore_case, lp ) &&
+      !parse_factor( pat, ignore_case, lp ) )
+    { free( lp->text ); lp->text = 0; lp->bufsz = 0; }
+  ep->used = ++cache_clock; ep->compiled = true;
+  return last_regexp = ep;
+  }
+
+
+/* Compile in *rep a copy of the regex of ep for a worker thread, and
+   return it, or return the regex of ep itself if its literal is matched
+   without regexec. Return 0 if error. */
+static const regex_t * copy_regex( const Regex_entry * const ep,
+                                   regex_t * const rep )
+  {
+  if( ep->lit.text && ep->lit.exact ) return &ep->re;
+  return ( regcomp( rep, ep->pat, ep->cflags ) == 0 ) ? rep : 0;
   }
 
 
 /* return pointer to compiled regex from command buffer, or to previous
    compiled regex if empty RE. return 0 if error */
-static regex_t * get_compiled_regex( const char ** const ibufpp )
+static Regex_entry * get_compiled_regex( const char ** const ibufpp )
   {
   const char delimiter = **ibufpp;
 
@@ -191,12 +425,9 @@ bool set_subst_regex( const char * const pat, const bool ignore_case )
   if( !*pat && ignore_case ) { set_error_msg( inv_i_suf ); return false; }
 
   disable_interrupts();
-  regex_t * exp = *pat ? compile_regex( pat, ignore_case ) : last_regexp;
-  if( exp && exp != subst_regexp )
-    {
-    if( subst_regexp ) regfree( subst_regexp );
-    subst_regexp = exp;
-    }
+  Regex_entry * const exp =
+    *pat ? compile_regex( pat, ignore_case ) : last_regexp;
+  if( exp ) subst_regexp = exp;
   enable_interrupts();
   return exp ? true : false;
   }
@@ -206,34 +437,278 @@ bool set_subst_regex( const char * const pat, const bool ignore_case )
 bool replace_subst_re_by_search_re( void )
   {
   if( !last_regexp ) { set_error_msg( no_prev_pat ); return false; }
-  if( last_regexp != subst_regexp )
+  subst_regexp = last_regexp;
+  return true;
+  }
+
+
+/* Return the text of a line to be matched, or 0 if error. If regexec
+   supports REG_STARTEND, a line whose text is in memory and contains no
+   NULs is matched in place. Else the line is copied, with its NULs turned
+   into newlines if the buffer is binary, and *copiedp is set.
+   regexec can't match lines longer than the range of regoff_t, which is
+   int in some systems. */
+static char * get_match_line( const line_node * const lp,
+                              bool * const copiedp )
+  {
+  const long len = node_len( lp );
+
+  if( sizeof (regoff_t) < sizeof len && len >= INT_MAX )
+    { set_error_msg( "Line too long" ); return 0; }
+  if( REG_STARTEND )
     {
-    disable_interrupts();
-    if( subst_regexp ) regfree( subst_regexp );
-    subst_regexp = last_regexp;
-    enable_interrupts();
+    long size = len;
+    const char * const p = get_sbuf_line_part( lp, 0, &size );
+    if( !p ) return 0;
+    if( size == len && ( !isbinary() || !memchr( p, 0, len ) ) )
+      { *copiedp = false; return (char *)p; }
     }
+  char * const s = get_sbuf_line( lp );
+  if( s && isbinary() ) nul_to_newline( s, len );
+  *copiedp = true;
+  return s;
+  }
+
+
+/* return true if the first n bytes at s are equal to those of the literal */
+static bool equal_literal( const Literal * const lp,
+                           const unsigned char * s, long n )
+  {
+  const unsigned char * p = (const unsigned char *)lp->text;
+  if( !lp->icase ) return memcmp( s, p, n ) == 0;
+  while( --n >= 0 ) if( lp->fold[*s++] != *p++ ) return false;
   return true;
   }
 
 
+/* Return the offset of the first occurrence of the literal in the len
+   bytes at s, or -1 if not found. */
+static long find_literal( const Literal * const lp,
+                          const unsigned char * const s, const long len )
+  {
+  const long m = lp->len;
+  long i;
+
+  if( m <= 0 ) return 0;
+  if( m > len ) return -1;
+  if( m == 1 && !lp->icase )
+    {
+    const unsigned char * const q =
+      (const unsigned char *)memchr( s, lp->text[0], len );
+    return q ? q - s : -1;
+    }
+  const unsigned char last = lp->text[m-1];
+  for( i = 0; i <= len - m; i += lp->skip[s[i+m-1]] )
+    if( lp->fold[s[i+m-1]] == last && equal_literal( lp, s + i, m - 1 ) )
+      return i;
+  return -1;
+  }
+
+
+/* Match a literal like regexec would match the regex. Without REG_NEWLINE,
+   '^' only matches at the beginning of the text and '$' at the end. */
+static int match_literal( const Literal * const lp, const char * const s,
+                          const long len, regmatch_t * const rm,
+                          const int eflags )
+  {
+  const unsigned char * const us = (const unsigned char *)s;
+  long i;
+
+  if( lp->bol )
+    {
+    if( ( eflags & REG_NOTBOL ) || lp->len > len ||
+        ( lp->eol && lp->len != len ) ||
+        !equal_literal( lp, us, lp->len ) ) return REG_NOMATCH;
+    i = 0;
+    }
+  else if( lp->eol )
+    {
+    i = len - lp->len;
+    if( i < 0 || !equal_literal( lp, us + i, lp->len ) )
+      return REG_NOMATCH;
+    }
+  else if( ( i = find_literal( lp, us, len ) ) < 0 ) return REG_NOMATCH;
+  rm[0].rm_so = i; rm[0].rm_eo = i + lp->len;
+  return 0;
+  }
+
+
+/* Match the len bytes of text at s with the regex of exp, using rexp,
+   which is the regex of exp or a copy of it, for regexec. Count the lines
+   searched for a required string in *psp. Without REG_STARTEND, the text
+   is always a copy terminated by a NUL. */
+static int match_text_with( const Regex_entry * const exp,
+                            const regex_t * const rexp, const char * const s,
+                            const long len, const int nmatch, regmatch_t * rm,
+                            const int eflags, Prefilter_stats * const psp )
+  {
+  regmatch_t m;
+  if( !rm ) rm = &m;
+  const Literal * const lp = &exp->lit;
+  if( lp->text )
+    {
+    if( lp->exact ) return match_literal( lp, s, len, rm, eflags );
+    ++psp->lines;
+    if( find_literal( lp, (const unsigned char *)s, len ) < 0 )
+      { ++psp->rejects; return REG_NOMATCH; }
+    }
+  rm[0].rm_so = 0; rm[0].rm_eo = len;
+  return regexec( rexp, s, nmatch, rm, eflags | REG_STARTEND );
+  }
+
+
+static int match_text( const Regex_entry * const exp, const char * const s,
+                       const long len, const int nmatch, regmatch_t * rm,
+                       const int eflags )
+  { return match_text_with( exp, &exp->re, s, len, nmatch, rm, eflags,
+                            &prefilter_stats ); }
+
+
+/* Like get_match_line, but may be called from several threads at once if
+   scratch_shared(). Lines not matched in place are copied to *bufp.
+   Return 0 and set *errorp if error. */
+static const char * get_match_line_shared( const line_node * const lp,
+                                           char ** const bufp,
+                                           long * const bufszp,
+                                           const char ** const errorp )
+  {
+  const long len = node_len( lp );
+  long off, size = len;
+
+  if( sizeof (regoff_t) < sizeof len && len >= INT_MAX )
+    { *errorp = "Line too long"; return 0; }
+  const char * p = get_sbuf_line_shared( lp, 0, &size );
+  if( REG_STARTEND && size == len && ( !isbinary() || !memchr( p, 0, len ) ) )
+    return p;
+  if( *bufszp <= len )
+    {
+    char * const buf = (char *)realloc( *bufp, len + 1 );
+    if( !buf ) { *errorp = mem_msg; return 0; }
+    *bufp = buf; *bufszp = len + 1;
+    }
+  for( off = 0; off < len; off += size )
+    { size = len - off; p = get_sbuf_line_shared( lp, off, &size );
+      memcpy( *bufp + off, p, size ); }
+  (*bufp)[len] = 0;
+  if( isbinary() ) nul_to_newline( *bufp, len );
+  return *bufp;
+  }
+
+
+/* The lines of a range of a global command are matched in parts by up to
+   'jobs()' threads, each with its own copy of the regex, because regexec
+   does not run concurrently on the same regex. The lines selected by each
+   part are then added to the global-active list in order. */
+typedef struct
+  {
+  const Regex_entry * exp;
+  const line_node * first;	/* first line of the part */
+  long n;			/* number of lines of the part */
+  bool match;			/* select matching lines */
+  const line_node ** found;	/* lines selected */
+  long found_len;
+  long found_size;
+  Prefilter_stats ps;
+  const char * error;		/* error message, or 0 */
+  }
+Match_part;
+
+
+/* Match the lines of a part. Runs in a worker thread, so it must not
+   report errors. */
+static void * match_part( void * const arg )
+  {
+  Match_part * const mp = (Match_part *)arg;
+  regex_t re;
+  char * buf = 0;
+  long bufsz = 0, i;
+
+  mp->found = 0; mp->found_len = mp->found_size = 0;
+  mp->ps.lines = mp->ps.rejects = 0; mp->error = 0;
+  const regex_t * const rexp = copy_regex( mp->exp, &re );
+  if( !rexp ) { mp->error = mem_msg; return 0; }
+  const line_node * lp = mp->first;
+  for( i = 0; i < mp->n; ++i, lp = next_line_node( lp ) )
+    {
+    const char * const s =
+      get_match_line_shared( lp, &buf, &bufsz, &mp->error );
+    if( !s ) break;
+    if( mp->match != !match_text_with( mp->exp, rexp, s, node_len( lp ), 0,
+                                       0, 0, &mp->ps ) ) continue;
+    if( mp->found_len >= mp->found_size )
+      {
+      const long size = max( 1024L, 2 * mp->found_size );
+      const line_node ** const p = (const line_node **)
+        realloc( mp->found, size * sizeof mp->found[0] );
+      if( !p ) { mp->error = mem_msg; break; }
+      mp->found = p; mp->found_size = size;
+      }
+    mp->found[mp->found_len++] = lp;
+    }
+  free( buf );
+  if( rexp == &re ) regfree( &re );
+  return 0;
+  }
+
+
+/* Match the n lines from first_addr in parts by several threads, and add
+   those selected to the global-active list. Return false if error. */
+static bool build_active_list_parts( const Regex_entry * const exp,
+                                     const long first_addr, const long n,
+                                     const int nparts, const bool match )
+  {
+  Match_part parts[max_jobs];
+  bool ok = true;
+  int i;
+  long j;
+
+  for( i = 0; i < nparts; ++i )
+    {
+    const long from = n * i / nparts, to = n * ( i + 1 ) / nparts;
+    parts[i].exp = exp; parts[i].match = match;
+    parts[i].first = search_line_node( first_addr + from );
+    parts[i].n = to - from;
+    }
+  /* interrupts are held until the threads end */
+  disable_interrupts();
+  run_jobs( match_part, parts, sizeof parts[0], nparts );
+  enable_interrupts();
+  for( i = 0; i < nparts; ++i )
+    {
+    if( ok && parts[i].error ) { set_error_msg( parts[i].error ); ok = false; }
+    for( j = 0; ok && j < parts[i].found_len; ++j )
+      if( !set_active_node( parts[i].found[j] ) ) ok = false;
+    prefilter_stats.lines += parts[i].ps.lines;
+    prefilter_stats.rejects += parts[i].ps.rejects;
+    free( parts[i].found );
+    }
+  return ok;
+  }
+
+
 /* add lines matching a regular expression to the global-active list */
-bool build_active_list( const char ** const ibufpp, const int first_addr,
-                        const int second_addr, const bool match )
+bool build_active_list( const char ** const ibufpp, const long first_addr,
+                        const long second_addr, const bool match )
   {
-  int addr;
+  long addr;
 
-  const regex_t * const exp = get_compiled_regex( ibufpp );
+  enum { min_part_lines = 1 << 16 };
+  const Regex_entry * const exp = get_compiled_regex( ibufpp );
   if( !exp ) return false;
   clear_active_list();
+  const long n = second_addr - first_addr + 1;
+  const int nparts = max( 1, min( (long)jobs(), n / min_part_lines ) );
+  if( nparts > 1 && scratch_shared() )
+    return build_active_list_parts( exp, first_addr, n, nparts, match );
   const line_node * lp = search_line_node( first_addr );
-  for( addr = first_addr; addr <= second_addr; ++addr, lp = lp->q_forw )
+  for( addr = first_addr; addr <= second_addr;
+       ++addr, lp = next_line_node( lp ) )
     {
-    char * const s = get_sbuf_line( lp );
+    bool copied;
+    const char * const s = get_match_line( lp, &copied );
     if( !s ) return false;
-    if( isbinary() ) nul_to_newline( s, lp->len );
-    if( match == !regexec( exp, s, 0, 0, 0 ) && !set_active_node( lp ) )
-      return false;
+    if( match == !match_text( exp, s, node_len( lp ), 0, 0, 0 ) &&
+        !set_active_node( lp ) ) return false;
     }
   return true;
   }
@@ -241,11 +716,11 @@ bool build_active_list( const char ** const ibufpp, const int first_addr,
 
 /* return the address of the next line matching a regular expression in a
    given direction. wrap around begin/end of editor buffer if necessary */
-int next_matching_node_addr( const char ** const ibufpp )
+long next_matching_node_addr( const char ** const ibufpp )
   {
   const bool forward = ( **ibufpp == '/' );
-  const regex_t * const exp = get_compiled_regex( ibufpp );
-  int addr = current_addr();
+  const Regex_entry * const exp = get_compiled_regex( ibufpp );
+  long addr = current_addr();
 
   if( !exp ) return -1;
   do {
@@ -253,10 +728,10 @@ int next_matching_node_addr( const char ** const ibufpp )
     if( addr )
       {
       const line_node * const lp = search_line_node( addr );
-      char * const s = get_sbuf_line( lp );
+      bool copied;
+      const char * const s = get_match_line( lp, &copied );
       if( !s ) return -1;
-      if( isbinary() ) nul_to_newline( s, lp->len );
-      if( !regexec( exp, s, 0, 0, 0 ) ) return addr;
+      if( !match_text( exp, s, node_len( lp ), 0, 0, 0 ) ) return addr;
       }
     }
   while( addr != current_addr() );
@@ -270,8 +745,8 @@ int next_matching_node_addr( const char ** const ibufpp )
 bool extract_replacement( const char ** const ibufpp, const bool isglobal )
   {
   static char * buf = 0;		/* temporary buffer */
-  static int bufsz = 0;
-  int i = 0;
+  static long bufsz = 0;
+  long i = 0;
   const char delimiter = **ibufpp;
 
   if( delimiter == '\n' ) { set_error_msg( mis_pat_del ); return false; }
@@ -292,7 +767,7 @@ bool extract_replacement( const char ** const ibufpp, const bool isglobal )
         ( buf[i++] = *(*ibufpp)++ ) == '\n' && !isglobal )
       {
       /* not reached if isglobal; in command-list, newlines are unescaped */
-      int size = 0;
+      long size = 0;
       *ibufpp = get_stdin_line( &size );
       if( !*ibufpp ) return false;			/* error */
       if( size <= 0 ) return false;			/* EOF */
@@ -309,140 +784,408 @@ bool extract_replacement( const char ** const ibufpp, const bool isglobal )
   }
 
 
+/* State of the substitution of a line. In the main thread, the new text of
+   the line is written to the scratch buffer in parts of at most
+   txtbuf_size bytes, so that no copy of the whole line is needed. Worker
+   threads (shared) keep the new text of the lines of their part in txt, up
+   to part_bytes bytes, and report errors in error instead. */
+enum { part_bytes = 1 << 22 };
+
+typedef struct
+  {
+  const regex_t * rexp;		/* subst_regexp or a copy of it */
+  bool shared;			/* running in a worker thread */
+  char * buf;			/* copy of the line if shared */
+  long bufsz;
+  char * txt;			/* new text */
+  long txtsz;
+  long txtlen;			/* new text not yet written */
+  Prefilter_stats * psp;
+  const char * error;		/* error message if shared, or 0 */
+  }
+Subst_context;
+
+static Subst_context main_context = { 0, false, 0, 0, 0, 0, 0,
+                                      &prefilter_stats, 0 };
+
+
+static void subst_error( Subst_context * const cp, const char * const msg )
+  { if( cp->shared ) cp->error = msg; else set_error_msg( msg ); }
+
+
+/* Append len bytes at s to the new text of a line. Return false if
+   error, or without error if the part of a worker thread is full. */
+static bool put_text( Subst_context * const cp, const char * const s,
+                      const long len )
+  {
+  enum { txtbuf_size = 1 << 16 };
+
+  if( cp->shared )
+    {
+    if( cp->txtlen + len > part_bytes ) return false;	/* part is full */
+    if( cp->txtlen + len > cp->txtsz )
+      {
+      const long size = max( 2 * cp->txtsz, cp->txtlen + len );
+      char * const p = (char *)realloc( cp->txt, size );
+      if( !p ) { cp->error = mem_msg; return false; }
+      cp->txt = p; cp->txtsz = size;
+      }
+    }
+  else
+    {
+    if( cp->txtlen + len > txtbuf_size )
+      {
+      const long n = cp->txtlen;
+      cp->txtlen = 0;
+      if( !put_sbuf_text( cp->txt, n ) ) return false;
+      if( len >= txtbuf_size ) return put_sbuf_text( s, len );
+      }
+    if( !resize_buffer( &cp->txt, &cp->txtsz, txtbuf_size ) ) return false;
+    }
+  memcpy( cp->txt + cp->txtlen, s, len ); cp->txtlen += len;
+  return true;
+  }
+
+
 /* Produce replacement text from matched text and replacement template.
-   Return new offset to end of replacement text, or -1 if error. */
-static int replace_matched_text( char ** txtbufp, int * const txtbufszp,
-                                 const char * const txt,
-                                 const regmatch_t * const rm, int offset,
-                                 const int re_nsub )
+   Return false if error. */
+static bool replace_matched_text( Subst_context * const cp,
+                                  const char * const txt,
+                                  const regmatch_t * const rm,
+                                  const int re_nsub )
   {
-  int i;
+  long i;
 
   for( i = 0; i < rlen; ++i )
     {
     int n;
     if( rbuf[i] == '&' )
       {
-      int j = rm[0].rm_so; int k = rm[0].rm_eo;
-      if( !resize_buffer( txtbufp, txtbufszp, offset - j + k ) ) return -1;
-      while( j < k ) (*txtbufp)[offset++] = txt[j++];
+      if( !put_text( cp, txt + rm[0].rm_so, rm[0].rm_eo - rm[0].rm_so ) )
+        return false;
       }
     else if( rbuf[i] == '\\' && rbuf[++i] >= '1' && rbuf[i] <= '9' &&
              ( n = rbuf[i] - '0' ) <= re_nsub )
       {
-      int j = rm[n].rm_so; int k = rm[n].rm_eo;
-      if( !resize_buffer( txtbufp, txtbufszp, offset - j + k ) ) return -1;
-      while( j < k ) (*txtbufp)[offset++] = txt[j++];
+      if( rm[n].rm_so >= 0 &&
+          !put_text( cp, txt + rm[n].rm_so, rm[n].rm_eo - rm[n].rm_so ) )
+        return false;
       }
     else		/* preceding 'if' skipped escaping backslashes */
-      {
-      if( !resize_buffer( txtbufp, txtbufszp, offset + 1 ) ) return -1;
-      (*txtbufp)[offset++] = rbuf[i];
-      }
+      if( !put_text( cp, rbuf + i, 1 ) ) return false;
     }
-  if( !resize_buffer( txtbufp, txtbufszp, offset + 1 ) ) return -1;
-  (*txtbufp)[offset] = 0;
-  return offset;
+  return true;
   }
 
 
-/* Produce new text with one or all matches replaced in a line.
-   Return size of the new line text, 0 if no change, -1 if error */
-static int line_replace( char ** txtbufp, int * const txtbufszp,
+/* Produce new text with one or all matches replaced in a line. In the main
+   thread, write it to the scratch buffer with put_sbuf_text; nothing is
+   written until the first replacement. Return 1 if the line changes, 0 if
+   no change, -1 if error or if the part of a worker thread is full. Must be
+   called with interrupts disabled in the main thread. */
+static int line_replace( Subst_context * const cp,
                          const line_node * const lp, const int snum )
   {
   enum { se_max = 30 };	/* max subexpressions in a regular expression */
   regmatch_t rm[se_max];
-  char * txt = get_sbuf_line( lp );
+  bool copied;
+  char * txt;
   const char * eot;
-  int i = 0, offset = 0;
+  char * start;			/* text not yet written */
   const bool global = ( snum <= 0 );
   bool changed = false;
 
+  if( cp->shared )
+    {
+    txt = (char *)get_match_line_shared( lp, &cp->buf, &cp->bufsz,
+                                         &cp->error );
+    copied = txt == cp->buf;
+    }
+  else txt = get_match_line( lp, &copied );
   if( !txt ) return -1;
-  if( isbinary() ) nul_to_newline( txt, lp->len );
-  eot = txt + lp->len;
-  if( !regexec( subst_regexp, txt, se_max, rm, 0 ) )
+  start = txt; eot = txt + node_len( lp );
+  if( !match_text_with( subst_regexp, cp->rexp, txt, eot - txt, se_max, rm,
+                        0, cp->psp ) )
     {
     int matchno = 0;
     bool infloop = false;
     do {
       if( global || snum == ++matchno )
         {
-        changed = true; i = rm[0].rm_so;
-        if( !resize_buffer( txtbufp, txtbufszp, offset + i ) ) return -1;
-        if( isbinary() ) newline_to_nul( txt, rm[0].rm_eo );
-        memcpy( *txtbufp + offset, txt, i ); offset += i;
-        offset = replace_matched_text( txtbufp, txtbufszp, txt, rm, offset,
-                                       subst_regexp->re_nsub );
-        if( offset < 0 ) return -1;
-        }
-      else
-        {
-        i = rm[0].rm_eo;
-        if( !resize_buffer( txtbufp, txtbufszp, offset + i ) ) return -1;
-        if( isbinary() ) newline_to_nul( txt, i );
-        memcpy( *txtbufp + offset, txt, i ); offset += i;
+        changed = true;
+        if( copied && isbinary() )
+          newline_to_nul( start, txt + rm[0].rm_eo - start );
+        if( !put_text( cp, start, txt + rm[0].rm_so - start ) ||
+            !replace_matched_text( cp, txt, rm, subst_regexp->re.re_nsub ) )
+          return -1;
+        start = txt + rm[0].rm_eo;
         }
       txt += rm[0].rm_eo;
       if( global && rm[0].rm_eo == 0 )
         { if( !infloop ) infloop = true;	/* 's/^/#/g' is valid */
-          else { set_error_msg( "Infinite substitution loop" ); return -1; } }
+          else { subst_error( cp, "Infinite substitution loop" );
+                 return -1; } }
+      }
+    while( txt < eot && ( !changed || global ) &&
+           !match_text_with( subst_regexp, cp->rexp, txt, eot - txt, se_max,
+                             rm, REG_NOTBOL, cp->psp ) );
+    if( changed )
+      {
+      if( copied && isbinary() ) newline_to_nul( start, eot - start );
+      if( !put_text( cp, start, eot - start ) || !put_text( cp, "\n", 1 ) )
+        return -1;					/* tail copy */
+      if( !cp->shared )
+        {
+        const long n = cp->txtlen;
+        cp->txtlen = 0;
+        if( !put_sbuf_text( cp->txt, n ) ) return -1;
+        }
       }
-    while( *txt && ( !changed || global ) &&
-           !regexec( subst_regexp, txt, se_max, rm, REG_NOTBOL ) );
-    i = eot - txt;
-    if( !resize_buffer( txtbufp, txtbufszp, offset + i + 2 ) ) return -1;
-    if( isbinary() ) newline_to_nul( txt, i );
-    memcpy( *txtbufp + offset, txt, i );		/* tail copy */
-    memcpy( *txtbufp + offset + i, "\n", 2 );
     }
-  return changed ? offset + i + 1 : 0;
+  return changed;
+  }
+
+
+/* Replace the line at *addrp by its new text of size bytes at txt, already
+   written to the scratch buffer if txt == 0, and make *addrp the address
+   of the last line inserted. Return false if error. */
+static bool commit_line( long * const addrp, const char * const txt,
+                         const long size, const bool isglobal )
+  {
+  undo_atom * up = 0;
+
+  disable_interrupts();
+  if( ( txt && !put_sbuf_text( txt, size ) ) ||
+      !delete_lines( *addrp, *addrp, isglobal ) )
+    { discard_sbuf_text(); enable_interrupts(); return false; }
+  set_current_addr( *addrp - 1 );
+  if( insert_sbuf_text( &up ) < 0 ) { enable_interrupts(); return false; }
+  *addrp = current_addr();
+  enable_interrupts();
+  return true;
   }
 
 
-/* for each line in a range, change text matching a regular expression
-   according to a substitution template (replacement); return false if error */
-bool search_and_replace( const int first_addr, const int second_addr,
+/* The substitutions in a large range are computed in rounds of up to
+   'jobs()' parts of up to part_lines lines, each by its own thread. Then
+   the main thread replaces the changed lines in order, as if it had
+   computed them, so that the undo atoms and the current address are the
+   same. The threads only read the buffer. A thread stops at the first
+   line that does not fit in part_bytes of new text, and the main thread
+   substitutes the rest of the part itself, so that the memory used does
+   not depend on the length of the lines. */
+enum { part_lines = 1 << 15 };
+
+typedef struct
+  {
+  const line_node * first;	/* first line of the part */
+  long n;			/* number of lines of the part */
+  int snum;
+  Subst_context c;		/* txt holds the new text of all lines */
+  long * changed;		/* index in part of each line changed */
+  long * ends;			/* end of its new text in c.txt */
+  long changed_len;
+  long changed_size;
+  long error_line;		/* index of the first line not done, or n */
+  }
+Subst_part;
+
+/* kept between rounds, so that nothing is lost if interrupted */
+static Subst_part parts[max_jobs];
+static Prefilter_stats part_stats[max_jobs];
+
+
+/* Compute the new text of the lines of a part. Runs in a worker thread,
+   so it must not report errors. */
+static void * subst_part( void * const arg )
+  {
+  Subst_part * const sp = (Subst_part *)arg;
+  Subst_context * const cp = &sp->c;
+  regex_t re;
+  long i;
+
+  cp->txtlen = 0; cp->error = 0;
+  cp->psp->lines = cp->psp->rejects = 0;
+  sp->changed_len = 0; sp->error_line = 0;
+  cp->rexp = copy_regex( subst_regexp, &re );
+  if( !cp->rexp ) { cp->error = mem_msg; return 0; }
+  const line_node * lp = sp->first;
+  for( i = 0; i < sp->n; ++i, lp = next_line_node( lp ) )
+    {
+    if( node_len( lp ) >= part_bytes ) break;	/* left to main thread */
+    const int ret = line_replace( cp, lp, sp->snum );
+    if( ret < 0 ) break;
+    if( ret == 0 ) continue;
+    if( sp->changed_len >= sp->changed_size )
+      {
+      const long size = max( 1024L, 2 * sp->changed_size );
+      long * const p = (long *)realloc( sp->changed, size * sizeof (long) );
+      long * const q = p ?
+        (long *)realloc( sp->ends, size * sizeof (long) ) : 0;
+      if( p ) sp->changed = p;
+      if( q ) sp->ends = q;
+      if( !q ) { cp->error = mem_msg; break; }
+      sp->changed_size = size;
+      }
+    sp->changed[sp->changed_len] = i; sp->ends[sp->changed_len++] = cp->txtlen;
+    }
+  sp->error_line = i;
+  if( cp->rexp == &re ) regfree( &re );
+  return 0;
+  }
+
+
+/* Free the buffers of the parts. Called with interrupts disabled. */
+static void free_subst_parts( void )
+  {
+  int i;
+
+  for( i = 0; i < max_jobs; ++i )
+    {
+    Subst_part * const sp = &parts[i];
+    free( sp->c.buf ); sp->c.buf = 0; sp->c.bufsz = 0;
+    free( sp->c.txt ); sp->c.txt = 0; sp->c.txtsz = 0;
+    free( sp->changed ); sp->changed = 0;
+    free( sp->ends ); sp->ends = 0; sp->changed_size = 0;
+    }
+  }
+
+
+/* Substitute the line at *addrp in the main thread, and set *addrp to
+   the address of the line following its new text. Set *match_foundp if
+   the line changes. Return false if error. */
+static bool subst_line( long * const addrp, const int snum,
+                        const bool isglobal, bool * const match_foundp )
+  {
+  Subst_context * const cp = &main_context;
+
+  disable_interrupts();
+  pin_sbuf( true );
+  const int ret = line_replace( cp, search_line_node( *addrp ), snum );
+  pin_sbuf( false );
+  if( ret < 0 )
+    { cp->txtlen = 0; discard_sbuf_text(); enable_interrupts();
+      return false; }
+  if( ret > 0 )
+    {
+    if( !commit_line( addrp, 0, 0, isglobal ) )
+      { enable_interrupts(); return false; }
+    *match_foundp = true;
+    }
+  enable_interrupts();
+  ++*addrp;
+  return true;
+  }
+
+
+/* Substitute up to *np lines from *addrp in up to nparts parts by several
+   threads. Each part gets an even share of the lines, but no more old text
+   than half part_bytes, leaving room for the replacements. Set *np to the
+   number of lines done, *addrp to the address of the line following them,
+   and *match_foundp if any line changes. Return false if error. */
+static bool subst_parts( long * const addrp, long * const np, int nparts,
+                         const int snum, const bool isglobal,
+                         bool * const match_foundp )
+  {
+  const line_node * lp = search_line_node( *addrp );
+  long addr = *addrp;			/* address of line 0 of the part */
+  long from = 0;
+  int i;
+
+  for( i = 0; i < nparts && from < *np; ++i )
+    {
+    Subst_part * const sp = &parts[i];
+    const long share = ( *np - from + nparts - i - 1 ) / ( nparts - i );
+    long k, size = 0;
+    sp->first = lp;
+    for( k = 0; k < share && size < part_bytes / 2; ++k )
+      { size += node_len( lp ) + 1; lp = next_line_node( lp ); }
+    sp->n = k; from += k;
+    sp->snum = snum; sp->c.shared = true; sp->c.psp = &part_stats[i];
+    }
+  *np = from; nparts = i;
+  /* interrupts are held until the threads end */
+  disable_interrupts();
+  run_jobs( subst_part, parts, sizeof parts[0], nparts );
+  enable_interrupts();
+  for( i = 0; i < nparts; ++i )
+    { prefilter_stats.lines += part_stats[i].lines;
+      prefilter_stats.rejects += part_stats[i].rejects; }
+  for( i = 0; i < nparts; ++i )
+    {
+    Subst_part * const sp = &parts[i];
+    long j, pos = 0, lines = 0;		/* lines inserted minus deleted */
+    for( j = 0; j < sp->changed_len; ++j )
+      {
+      long line_addr = addr + sp->changed[j] + lines;
+      if( !commit_line( &line_addr, sp->c.txt + pos, sp->ends[j] - pos,
+                        isglobal ) ) return false;
+      lines = line_addr - ( addr + sp->changed[j] );
+      pos = sp->ends[j];
+      *match_foundp = true;
+      }
+    if( sp->c.error ) { set_error_msg( sp->c.error ); return false; }
+    for( j = sp->error_line; j < sp->n; ++j )	/* rest of a full part */
+      {
+      long line_addr = addr + j + lines;
+      if( !subst_line( &line_addr, snum, isglobal, match_foundp ) )
+        return false;
+      lines = line_addr - ( addr + j + 1 );
+      }
+    addr += sp->n + lines;
+    }
+  *addrp = addr;
+  return true;
+  }
+
+
+/* For each line in a range, change text matching a regular expression
+   according to a substitution template (replacement); return false if
+   error. The scratch buffer is pinned while a line is replaced, so that
+   lines in memory can be matched and copied in place. Large ranges are
+   substituted in rounds by several threads if the text is in memory. */
+bool search_and_replace( const long first_addr, const long second_addr,
                          const int snum, const bool isglobal )
   {
-  static char * txtbuf = 0;		/* new text of line buffer */
-  static int txtbufsz = 0;		/* new text of line buffer size */
-  int addr = first_addr;
-  int lc;
+  const long n = second_addr - first_addr + 1;
+  const int nparts = min( (long)jobs(), n / part_lines );
+  long addr = first_addr;
+  long lc = 0;				/* lines done */
   bool match_found = false;
+  bool parallel = false;		/* the parts hold buffers */
+  bool ok = true;
 
-  for( lc = 0; lc <= second_addr - first_addr; ++lc, ++addr )
+  main_context.rexp = &subst_regexp->re;
+  while( ok && lc < n )
     {
-    const line_node * const lp = search_line_node( addr );
-    const int size = line_replace( &txtbuf, &txtbufsz, lp, snum );
-    if( size < 0 ) return false;
-    if( size )
+    if( nparts > 1 && scratch_shared() )
       {
-      const char * txt = txtbuf;
-      const char * const eot = txtbuf + size;
-      undo_atom * up = 0;
-      disable_interrupts();
-      if( !delete_lines( addr, addr, isglobal ) )
-        { enable_interrupts(); return false; }
-      set_current_addr( addr - 1 );
-      do {
-        txt = put_sbuf_line( txt, eot - txt );
-        if( !txt ) { enable_interrupts(); return false; }
-        if( up ) up->tail = search_line_node( current_addr() );
-        else
-          {
-          up = push_undo_atom( UADD, current_addr(), current_addr() );
-          if( !up ) { enable_interrupts(); return false; }
-          }
-        }
-      while( txt != eot );
-      enable_interrupts();
-      addr = current_addr();
-      match_found = true;
+      long round = min( n - lc, (long)nparts * part_lines );
+      parallel = true;
+      ok = subst_parts( &addr, &round, nparts, snum, isglobal, &match_found );
+      lc += round;
       }
+    else { ok = subst_line( &addr, snum, isglobal, &match_found ); ++lc; }
     }
+  if( parallel )
+    { disable_interrupts(); free_subst_parts(); enable_interrupts(); }
+  if( !ok ) return false;
   if( !match_found && !isglobal )
     { set_error_msg( no_match ); return false; }
   return true;
   }
+
+
+void print_regex_stats( void )
+  {
+  const Prefilter_stats * const psp = &prefilter_stats;
+  int i, used = 0;
+
+  for( i = 0; i < regex_cache_size; ++i )
+    if( regex_cache[i].compiled ) ++used;
+  fprintf( stderr, "regex cache: %ld hits, %ld misses, %d of %d entries "
+           "in use\n", cache_hits, cache_misses, used, regex_cache_size );
+  fprintf( stderr, "regex prefilter: %ld lines searched, %ld rejected "
+           "(%.1f%%)\n", psp->lines, psp->rejects,
+           psp->lines ? 100.0 * psp->rejects / psp->lines : 0.0 );
+  }
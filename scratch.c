@@ -0,0 +1,874 @@
+/* scratch.c: storage of the scratch buffer of the ed line editor. */
+/* GNU ed - The GNU line editor.
+   Copyright (C) 1993, 1994 Andrew L. Moore, Talke Studio
+   Copyright (C) 2006-2025 Antonio Diaz Diaz.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+   The text of the lines is appended to the scratch buffer, and is only
+   moved by compaction. The scratch buffer is kept by one of the backends
+   below, selected with the option --scratch:
+
+   memory      in chunks of memory until its size exceeds scratch_mem(),
+               then moved to the mmap backend (the default).
+   mmap        in a temporary file mapped in memory, so that lines are read
+               without system calls. If the mapping can't be grown, the
+               file is used through the file backend.
+   file        in a temporary file accessed through stdio.
+   compressed  in chunks of memory, of which the least recently used are
+               compressed to a temporary file when they take more than
+               scratch_mem() bytes.
+
+   The backend in use may thus differ from the one selected. All the
+   backends write and read at any position not beyond the end of the text.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "ed.h"
+
+
+typedef struct
+  {
+  const char * name;
+  bool (*open)( void );		/* create empty storage and make it current */
+  bool (*close)( void );	/* release the storage */
+  bool (*write)( const char * const buf, const long pos, const long len );
+  bool (*read)( char * const buf, const long pos, const long len );
+  /* return a pointer to the text at pos, and reduce *sizep to the bytes
+     available there; 0 if error. 0 if the text is not kept in memory. */
+  const char * (*view)( const long pos, long * const sizep );
+  bool (*truncate)( const long size );
+  void (*stats)( void );	/* print details to stderr, or 0 */
+  }
+Scratch_backend;
+
+static const Scratch_backend memory_backend, mmap_backend, file_backend,
+                             compressed_backend;
+static const Scratch_backend * selected = &memory_backend;
+static const Scratch_backend * sb = 0;	/* backend in use */
+static long ssize = 0;		/* bytes written to scratch buffer */
+
+static char ** mchunks = 0;	/* chunks of in-memory scratch buffer */
+static int mchunks_len = 0;	/* number of chunks allocated */
+static int sfd = -1;		/* descriptor of mapped scratch file */
+static char * smap = 0;		/* mapping of scratch file, or 0 */
+static long smapsz = 0;		/* size of mapping and of scratch file */
+static long smapend = 0;	/* end of the text written to smap */
+static FILE * sfp = 0;		/* scratch file pointer */
+static long sfpos = -1;		/* scratch file position, or -1 */
+static bool sfwriting = false;	/* last access to sfp was a write */
+
+/* While the scratch buffer is pinned, the memory holding the text already
+   written is not released when the scratch buffer is remapped or moved to
+   a file, so that the pointers returned by get_scratch_part remain valid
+   while new text is written. The memory is released when unpinned.
+   Compressed chunks don't need this; the chunk of the last part returned
+   is never released. */
+enum { max_retired_maps = 64 };	/* the mapping doubles each time */
+static bool sbuf_pinned = false;
+static char * retired_maps[max_retired_maps];
+static long retired_mapszs[max_retired_maps];
+static int retired_maps_len = 0;
+static char ** retired_mchunks = 0;
+static int retired_mchunks_len = 0;
+
+/* State of the chunks of the compressed backend. Chunks not in memory
+   have mchunks[i] == 0. */
+typedef struct
+  {
+  long zpos;			/* position in zfd of compressed text, or -1 */
+  int zsize;			/* size of compressed text */
+  int zcap;			/* space reserved for it in zfd */
+  bool raw;			/* text did not compress; stored as is */
+  bool dirty;			/* text changed since compressed */
+  long used;			/* time of last access, for LRU */
+  }
+Zchunk;
+static Zchunk * zchunks = 0;	/* one per chunk if compressing */
+static int * resident = 0;	/* chunks in memory if compressing */
+static int resident_len = 0;
+static long mchunks_end = 0;	/* end of the text written to chunks */
+static int zfd = -1;		/* file of compressed chunks */
+static long zfile_size = 0;
+static long zfile_garbage = 0;	/* bytes of zfd no longer used */
+static long chunk_clock = 0;
+static long zchunks_loaded = 0, zchunks_saved = 0;
+static int viewed_chunk = -1;	/* chunk of last get_scratch_part */
+
+
+/* Create an unlinked temporary file in TMPDIR.
+   Return its file descriptor, or -1 if error. */
+static int create_scratch_file( void )
+  {
+  const char * dir = getenv( "TMPDIR" );
+  if( !dir || !dir[0] ) dir = "/tmp";
+  const char * const name = "/ed-scratch-XXXXXX";
+  const int len = strlen( dir ) + strlen( name ) + 1;
+  char * const tmpname = (char *)malloc( len );
+  if( !tmpname ) return -1;
+  snprintf( tmpname, len, "%s%s", dir, name );
+  const int fd = mkstemp( tmpname );
+  if( fd >= 0 ) unlink( tmpname );
+  free( tmpname );
+  return fd;
+  }
+
+
+void pin_sbuf( const bool pin )
+  {
+  sbuf_pinned = pin;
+  if( pin ) return;
+  while( retired_maps_len > 0 )
+    { --retired_maps_len;
+      munmap( retired_maps[retired_maps_len],
+              retired_mapszs[retired_maps_len] ); }
+  if( retired_mchunks )
+    {
+    while( retired_mchunks_len > 0 )
+      free( retired_mchunks[--retired_mchunks_len] );
+    free( retired_mchunks ); retired_mchunks = 0;
+    }
+  }
+
+
+/* The file backend. Reads and writes are positioned with fseek only when
+   needed, so that appending text and reading consecutive lines don't make
+   system calls other than those of stdio. */
+
+static bool file_open( void )
+  {
+  sfp = tmpfile();
+  if( !sfp )
+    {
+    show_strerror( 0, errno );
+    set_error_msg( "Cannot open temp file" );
+    return false;
+    }
+  sfpos = 0; sfwriting = true;
+  sb = &file_backend;
+  return true;
+  }
+
+
+static bool file_close( void )
+  {
+  const bool error = fclose( sfp ) != 0;
+  sfp = 0; sfd = -1;			/* sfd belonged to sfp if any */
+  sfpos = -1;
+  if( error )
+    {
+    show_strerror( 0, errno );
+    set_error_msg( "Cannot close temp file" );
+    return false;
+    }
+  return true;
+  }
+
+
+/* Set the file position to pos for a write or a read. Stdio requires a
+   seek between a write and a read. */
+static bool file_seek( const long pos, const bool write )
+  {
+  if( sfpos == pos && sfwriting == write ) return true;
+  if( fseek( sfp, pos, SEEK_SET ) != 0 )
+    {
+    sfpos = -1;
+    show_strerror( 0, errno );
+    set_error_msg( "Cannot seek temp file" );
+    return false;
+    }
+  sfpos = pos; sfwriting = write;
+  return true;
+  }
+
+
+static bool file_write( const char * const buf, const long pos,
+                        const long len )
+  {				/* assert: interrupts disabled */
+  if( !file_seek( pos, true ) ) return false;
+  if( (long)fwrite( buf, 1, len, sfp ) != len )
+    {
+    sfpos = -1;
+    show_strerror( 0, errno );
+    set_error_msg( "Cannot write temp file" );
+    return false;
+    }
+  sfpos += len;				/* update file position */
+  return true;
+  }
+
+
+static bool file_read( char * const buf, const long pos, const long len )
+  {
+  if( !file_seek( pos, false ) ) return false;
+  if( (long)fread( buf, 1, len, sfp ) != len )
+    {
+    sfpos = -1;
+    show_strerror( 0, errno );
+    set_error_msg( "Cannot read temp file" );
+    return false;
+    }
+  sfpos += len;				/* update file position */
+  return true;
+  }
+
+
+static bool file_truncate( const long size )
+  {
+  sfpos = -1;
+  if( fflush( sfp ) != 0 || ftruncate( fileno( sfp ), size ) != 0 )
+    {
+    show_strerror( 0, errno );
+    set_error_msg( "Cannot write temp file" );
+    return false;
+    }
+  return true;
+  }
+
+
+/* The mmap backend. */
+
+/* unmap a mapping of the scratch file, or retire it if pinned */
+static void unmap_smap( char * const map, const long size )
+  {
+  if( sbuf_pinned && retired_maps_len < max_retired_maps )
+    { retired_maps[retired_maps_len] = map;
+      retired_mapszs[retired_maps_len++] = size; }
+  else munmap( map, size );
+  }
+
+
+/* Stop mapping the scratch file and continue using it through the file
+   backend. Used if the mapping can't be grown. Return false if error. */
+static bool unmap_sbuf( void )
+  {
+  if( smap ) { unmap_smap( smap, smapsz ); smap = 0; smapsz = 0; }
+  if( ftruncate( sfd, smapend ) != 0 || !( sfp = fdopen( sfd, "w+" ) ) )
+    return false;
+  sfpos = -1;
+  sb = &file_backend;
+  return true;
+  }
+
+
+/* Make room in the mapped scratch file for at least min_size bytes.
+   The size is doubled to make the number of remappings logarithmic. */
+static bool grow_sbuf_map( const long min_size )
+  {
+  enum { min_map_size = 1 << 20 };
+  long new_size = max( smapsz, (long)min_map_size );
+  while( new_size < min_size )
+    { if( new_size > LONG_MAX / 2 ) { new_size = min_size; break; }
+      new_size *= 2; }
+  /* allocate the blocks now to get ENOSPC instead of SIGBUS later */
+  const int err = posix_fallocate( sfd, smapsz, new_size - smapsz );
+  if( err == EINVAL || err == EOPNOTSUPP )	/* not supported by the fs */
+    { if( ftruncate( sfd, new_size ) != 0 ) return false; }
+  else if( err ) { errno = err; return false; }
+  void * const p = mmap( 0, new_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         sfd, 0 );
+  if( p == MAP_FAILED ) return unmap_sbuf();
+  if( smap ) unmap_smap( smap, smapsz );
+  smap = (char *)p; smapsz = new_size;
+  return true;
+  }
+
+
+/* Open a mapped scratch file, or a stdio one if it can't be mapped. */
+static bool mmap_open( void )
+  {
+  sb = &mmap_backend; smapend = 0;
+  sfd = create_scratch_file();
+  if( sfd >= 0 )
+    {
+    if( grow_sbuf_map( 0 ) ) return true;
+    if( smap ) { munmap( smap, smapsz ); smap = 0; smapsz = 0; }
+    if( sfp ) { fclose( sfp ); sfp = 0; } else close( sfd );
+    sfd = -1;
+    }
+  return file_open();
+  }
+
+
+static bool mmap_close( void )
+  {
+  if( smap ) { munmap( smap, smapsz ); smap = 0; smapsz = 0; }
+  if( sfd >= 0 ) { close( sfd ); sfd = -1; }
+  return true;
+  }
+
+
+static bool mmap_write( const char * const buf, const long pos,
+                        const long len )
+  {
+  if( pos + len > smapsz && !grow_sbuf_map( pos + len ) )
+    {
+    show_strerror( 0, errno );
+    set_error_msg( "Cannot write temp file" );
+    return false;
+    }
+  if( !smap ) return file_write( buf, pos, len );	/* now unmapped */
+  memcpy( smap + pos, buf, len );
+  if( pos + len > smapend ) smapend = pos + len;
+  return true;
+  }
+
+
+static bool mmap_read( char * const buf, const long pos, const long len )
+  { memcpy( buf, smap + pos, len ); return true; }
+
+
+static const char * mmap_view( const long pos, long * const sizep )
+  {
+  if( sizep ) {}			/* keep compiler happy */
+  return smap + pos;
+  }
+
+
+static bool mmap_truncate( const long size )
+  {
+  munmap( smap, smapsz ); smap = 0; smapsz = 0;
+  smapend = size;
+  if( ftruncate( sfd, size ) != 0 ||
+      ( !grow_sbuf_map( size ) && !unmap_sbuf() ) )
+    {
+    show_strerror( 0, errno );
+    set_error_msg( "Cannot write temp file" );
+    return false;
+    }
+  return true;
+  }
+
+
+static void mmap_stats( void )
+  { fprintf( stderr, "mapped file: %ld bytes\n", smapsz ); }
+
+
+/* The memory and compressed backends keep the scratch buffer in chunks of
+   mchunk_size bytes. The compressed backend keeps in memory at most
+   max_resident() chunks. The least recently used ones are compressed to a
+   temporary file and released, and are decompressed again when needed.
+   A chunk is only compressed again if it has changed. */
+enum { mchunk_size = 1 << 18, min_resident = 4 };
+
+static void free_mchunks( void )
+  {
+  if( sbuf_pinned && !retired_mchunks )
+    { retired_mchunks = mchunks; retired_mchunks_len = mchunks_len;
+      mchunks_len = 0; }
+  while( mchunks_len > 0 ) free( mchunks[--mchunks_len] );
+  if( mchunks != retired_mchunks ) free( mchunks );
+  mchunks = 0;
+  free( zchunks ); zchunks = 0;
+  free( resident ); resident = 0; resident_len = 0;
+  if( zfd >= 0 ) { close( zfd ); zfd = -1; }
+  zfile_size = zfile_garbage = 0; mchunks_end = 0; viewed_chunk = -1;
+  }
+
+
+static int max_resident( void )
+  { return max( (long)min_resident, scratch_mem() / mchunk_size ); }
+
+
+/* Create an unlinked temporary file in TMPDIR, or in the directory of
+   tmpfile if TMPDIR is not usable. Used for the compressed chunks and for
+   the line index. Return its file descriptor, or -1 if error. */
+int create_temp_file( void )
+  {
+  int fd = create_scratch_file();
+  if( fd < 0 )
+    {
+    FILE * const fp = tmpfile();
+    if( fp ) { fd = dup( fileno( fp ) ); fclose( fp ); }
+    }
+  return fd;
+  }
+
+
+/* write or read size bytes at position pos of zfd */
+static bool zfile_io( char * const buf, const long size, const long pos,
+                      const bool write )
+  {
+  long done = 0;
+  while( done < size )
+    {
+    const long n = write ? pwrite( zfd, buf + done, size - done, pos + done )
+                         : pread( zfd, buf + done, size - done, pos + done );
+    if( n < 0 && errno == EINTR ) continue;
+    if( n <= 0 ) { if( n == 0 ) errno = EIO; return false; }
+    done += n;
+    }
+  return true;
+  }
+
+
+/* Compress chunk i, which is in memory, to zfd if it has changed.
+   Reuse the space of its previous compressed text if it fits.
+   Return false if error. */
+static bool save_zchunk( const int i )
+  {
+  static char * zbuf = 0;
+  Zchunk * const zp = &zchunks[i];
+
+  if( !zp->dirty ) return true;
+  if( !zbuf && !( zbuf = (char *)malloc( mchunk_size ) ) )
+    { show_strerror( 0, errno ); set_error_msg( mem_msg ); return false; }
+  if( zfd < 0 && ( zfd = create_temp_file() ) < 0 )
+    { show_strerror( 0, errno );
+      set_error_msg( "Cannot open temp file" ); return false; }
+  const long len =
+    min( mchunks_end - (long)i * mchunk_size, (long)mchunk_size );
+  long zsize = lz_compress( mchunks[i], len, zbuf, len );
+  const bool raw = zsize <= 0;
+  if( raw ) zsize = len;
+  if( zp->zpos < 0 || zsize > zp->zcap )
+    {
+    if( zp->zpos >= 0 ) zfile_garbage += zp->zcap;
+    zp->zpos = zfile_size; zp->zcap = zsize; zfile_size += zsize;
+    }
+  if( !zfile_io( raw ? mchunks[i] : zbuf, zsize, zp->zpos, true ) )
+    { show_strerror( 0, errno );
+      set_error_msg( "Cannot write temp file" ); return false; }
+  zp->zsize = zsize; zp->raw = raw; zp->dirty = false;
+  ++zchunks_saved;
+  return true;
+  }
+
+
+/* Copy the compressed chunks to a new file if most of zfd is garbage.
+   Return false if error. */
+static bool repack_zfile( void )
+  {
+  enum { min_garbage = 1 << 24 };
+  char * buf = 0;
+  long pos = 0;
+  int i;
+
+  if( zfile_garbage < min_garbage || zfile_garbage <= zfile_size / 2 )
+    return true;
+  const int fd = create_temp_file();
+  if( fd < 0 || !( buf = (char *)malloc( mchunk_size ) ) ) goto error;
+  for( i = 0; i < mchunks_len; ++i )
+    {
+    Zchunk * const zp = &zchunks[i];
+    if( zp->zpos < 0 ) continue;
+    if( !zfile_io( buf, zp->zsize, zp->zpos, false ) ) goto error;
+    const int old_fd = zfd;
+    zfd = fd;
+    const bool ok = zfile_io( buf, zp->zsize, pos, true );
+    zfd = old_fd;
+    if( !ok ) goto error;
+    zp->zpos = pos; zp->zcap = zp->zsize; pos += zp->zsize;
+    }
+  free( buf );
+  close( zfd ); zfd = fd;
+  zfile_size = pos; zfile_garbage = 0;
+  return true;
+error:
+  show_strerror( 0, errno );
+  set_error_msg( "Cannot write temp file" );
+  free( buf );
+  if( fd >= 0 ) close( fd );
+  return false;
+  }
+
+
+/* Release the least recently used chunk in memory, after saving it if it
+   has changed. The chunk of the last part returned by get_scratch_part
+   is kept, as its text may be in use. Return its buffer, or 0 if error. */
+static char * evict_zchunk( void )
+  {
+  int k, lru = -1;
+
+  for( k = 0; k < resident_len; ++k )
+    if( resident[k] != viewed_chunk &&
+        ( lru < 0 || zchunks[resident[k]].used < zchunks[resident[lru]].used ) )
+      lru = k;
+  const int i = resident[lru];
+  if( !save_zchunk( i ) ) return 0;
+  char * const p = mchunks[i];
+  mchunks[i] = 0;
+  resident[lru] = resident[--resident_len];
+  return p;
+  }
+
+
+/* Report the failure of an allocation for a chunk. The memory backend
+   reports it only if it can't spill the scratch buffer to a file. */
+static void chunk_mem_error( void )
+  {
+  if( sb == &compressed_backend )
+    { show_strerror( 0, errno ); set_error_msg( mem_msg ); }
+  }
+
+
+/* Return a buffer for a chunk, evicting another chunk if too many chunks
+   are in memory, and count the chunk i as in memory. Return 0 if error. */
+static char * new_chunk_buffer( const int i )
+  {
+  char * p = 0;
+
+  if( zchunks )
+    {
+    if( resident_len >= max_resident() && !( p = evict_zchunk() ) )
+      return 0;
+    resident[resident_len++] = i;
+    }
+  if( !p && !( p = (char *)malloc( mchunk_size ) ) )
+    { if( zchunks ) --resident_len;
+      chunk_mem_error(); }
+  return p;
+  }
+
+
+/* Return the text of chunk i, decompressing it if it is not in memory, or
+   0 if error. Mark it as changed if write is true. */
+static char * chunk_text( const int i, const bool write )
+  {
+  if( !zchunks ) return mchunks[i];
+  Zchunk * const zp = &zchunks[i];
+  if( !mchunks[i] )
+    {
+    static char * zbuf = 0;
+    char * const p = new_chunk_buffer( i );
+    if( !p ) return 0;
+    if( !zbuf && !( zbuf = (char *)malloc( mchunk_size ) ) )
+      { show_strerror( 0, errno ); set_error_msg( mem_msg ); }
+    else if( !zfile_io( zp->raw ? p : zbuf, zp->zsize, zp->zpos, false ) )
+      { show_strerror( 0, errno ); set_error_msg( "Cannot read temp file" ); }
+    else if( zp->raw ||
+             lz_decompress( zbuf, zp->zsize, p, mchunk_size ) >= 0 )
+      { mchunks[i] = p; ++zchunks_loaded; }
+    else set_error_msg( "Temp file is corrupt" );
+    if( !mchunks[i] ) { free( p ); --resident_len; return 0; }
+    }
+  zp->used = ++chunk_clock;
+  if( write ) zp->dirty = true;
+  return mchunks[i];
+  }
+
+
+/* copy len bytes at position pos of the in-memory scratch buffer to buf;
+   return false if error */
+static bool read_mchunks( char * buf, long pos, long len )
+  {
+  while( len > 0 )
+    {
+    const int off = pos % mchunk_size;
+    const int n = min( len, (long)( mchunk_size - off ) );
+    const char * const p = chunk_text( pos / mchunk_size, false );
+    if( !p ) return false;
+    memcpy( buf, p + off, n );
+    buf += n; pos += n; len -= n;
+    }
+  return true;
+  }
+
+
+/* copy len bytes of buf to position pos of the in-memory scratch buffer;
+   return false if error */
+static bool write_mchunks( const char * buf, long pos, long len )
+  {
+  while( len > 0 )
+    {
+    const int i = pos / mchunk_size;
+    const int off = pos % mchunk_size;
+    if( i >= mchunks_len )
+      {
+      char ** const p =
+        (char **)realloc( mchunks, ( mchunks_len + 1 ) * sizeof mchunks[0] );
+      if( !p ) { chunk_mem_error(); return false; }
+      mchunks = p;
+      if( sb == &compressed_backend )
+        {
+        Zchunk * const q = (Zchunk *)
+          realloc( zchunks, ( mchunks_len + 1 ) * sizeof zchunks[0] );
+        if( !q ) { show_strerror( 0, errno ); set_error_msg( mem_msg );
+                   return false; }
+        zchunks = q;
+        if( !resident &&
+            !( resident = (int *)malloc( max_resident() * sizeof (int) ) ) )
+          { show_strerror( 0, errno ); set_error_msg( mem_msg );
+            return false; }
+        Zchunk * const zp = &zchunks[mchunks_len];
+        zp->zpos = -1; zp->zsize = zp->zcap = 0; zp->raw = false;
+        zp->dirty = true; zp->used = 0;
+        }
+      if( !( mchunks[mchunks_len] = new_chunk_buffer( mchunks_len ) ) )
+        return false;
+      ++mchunks_len;
+      }
+    const int n = min( len, (long)( mchunk_size - off ) );
+    char * const p = chunk_text( i, true );
+    if( !p ) return false;
+    memcpy( p + off, buf, n );
+    buf += n; pos += n; len -= n;
+    if( pos > mchunks_end ) mchunks_end = pos;
+    }
+  return true;
+  }
+
+
+/* No file is created until the text exceeds scratch_mem() bytes. */
+static bool memory_open( void )
+  {
+  if( scratch_mem() <= 0 ) return mmap_open();
+  sb = &memory_backend;
+  return true;
+  }
+
+
+static bool compressed_open( void )
+  { sb = &compressed_backend; return true; }
+
+
+static bool mchunks_close( void ) { free_mchunks(); return true; }
+
+
+/* Move the in-memory scratch buffer to the mmap backend.
+   If error, leave the scratch buffer in memory. */
+static bool spill_mchunks( void )
+  {
+  long pos;
+
+  if( !mmap_open() ) { sb = &memory_backend; return false; }
+  for( pos = 0; pos < ssize; pos += mchunk_size )
+    if( !sb->write( mchunks[pos/mchunk_size], pos,
+                    min( ssize - pos, (long)mchunk_size ) ) ) break;
+  if( pos >= ssize ) { free_mchunks(); return true; }
+  sb->close();
+  sb = &memory_backend;
+  return false;
+  }
+
+
+/* If the text does not fit in memory, spill it to the mmap backend. */
+static bool memory_write( const char * const buf, const long pos,
+                          const long len )
+  {
+  int alloc_errno = 0;			/* errno of a failed allocation */
+
+  if( pos + len <= scratch_mem() )
+    {
+    if( write_mchunks( buf, pos, len ) ) return true;
+    alloc_errno = errno;
+    }
+  if( spill_mchunks() && sb->write( buf, pos, len ) ) return true;
+  if( alloc_errno )
+    { show_strerror( 0, alloc_errno ); set_error_msg( mem_msg ); }
+  return false;
+  }
+
+
+/* return the text up to the end of the chunk */
+static const char * mchunks_view( const long pos, long * const sizep )
+  {
+  const int i = pos / mchunk_size;
+  const int o = pos % mchunk_size;
+  const char * const p = chunk_text( i, false );
+  if( !p ) return 0;
+  *sizep = min( *sizep, (long)( mchunk_size - o ) );
+  viewed_chunk = i;
+  return p + o;
+  }
+
+
+static bool mchunks_truncate( const long size )
+  {
+  const int n = ( size + mchunk_size - 1 ) / mchunk_size;
+  while( mchunks_len > n )
+    {
+    free( mchunks[--mchunks_len] );
+    if( !zchunks ) continue;
+    const Zchunk * const zp = &zchunks[mchunks_len];
+    if( zp->zpos >= 0 ) zfile_garbage += zp->zcap;
+    int k;
+    for( k = 0; k < resident_len; ++k )
+      if( resident[k] == mchunks_len )
+        { resident[k] = resident[--resident_len]; break; }
+    }
+  mchunks_end = size;
+  if( viewed_chunk >= n ) viewed_chunk = -1;
+  return !zchunks || repack_zfile();
+  }
+
+
+static void compressed_stats( void )
+  {
+  fprintf( stderr, "compressed chunks: %d in memory of %d, %ld loaded, "
+           "%ld saved, file %ld bytes (%ld unused)\n", resident_len,
+           mchunks_len, zchunks_loaded, zchunks_saved, zfile_size,
+           zfile_garbage );
+  }
+
+
+static const Scratch_backend memory_backend =
+  { "memory", memory_open, mchunks_close, memory_write, read_mchunks,
+    mchunks_view, mchunks_truncate, 0 };
+static const Scratch_backend mmap_backend =
+  { "mmap", mmap_open, mmap_close, mmap_write, mmap_read, mmap_view,
+    mmap_truncate, mmap_stats };
+static const Scratch_backend file_backend =
+  { "file", file_open, file_close, file_write, file_read, 0, file_truncate,
+    0 };
+static const Scratch_backend compressed_backend =
+  { "compressed", compressed_open, mchunks_close, write_mchunks,
+    read_mchunks, mchunks_view, mchunks_truncate, compressed_stats };
+
+
+/* select the backend named name; return false if there is none */
+bool set_scratch_backend( const char * const name )
+  {
+  const Scratch_backend * const backends[] =
+    { &memory_backend, &mmap_backend, &file_backend, &compressed_backend };
+  const int backends_len = sizeof backends / sizeof backends[0];
+  int i;
+
+  for( i = 0; i < backends_len; ++i )
+    if( strcmp( name, backends[i]->name ) == 0 )
+      { selected = backends[i]; return true; }
+  return false;
+  }
+
+
+bool open_scratch( void )
+  { ssize = 0; return selected->open(); }
+
+
+bool close_scratch( void )
+  {
+  const bool ok = !sb || sb->close();
+  sb = 0; ssize = 0;
+  return ok;
+  }
+
+
+long scratch_size( void ) { return ssize; }
+
+
+/* Append len bytes of text to the scratch buffer.
+   Return the position of the text in the scratch buffer, or -1 if error. */
+long append_scratch( const char * const buf, const long len )
+  {
+  if( !sb->write( buf, ssize, len ) ) return -1;
+  ssize += len;
+  return ssize - len;
+  }
+
+
+/* copy len bytes at position pos of the scratch buffer to buf */
+bool read_scratch( char * const buf, const long pos, const long len )
+  { return sb->read( buf, pos, len ); }
+
+
+/* Return a pointer to the text at position pos of the scratch buffer, and
+   set *sizep to the size of the part returned, which is at most *sizep
+   bytes and may be less. Text in memory is not copied, else it is read
+   into a buffer of at most part_size bytes. The pointer is valid until the
+   next scratch buffer operation, or until the scratch buffer is unpinned
+   if it is pinned. Return 0 if error. */
+const char * get_scratch_part( const long pos, long * const sizep )
+  {
+  enum { part_size = 1 << 20 };
+  static char * buf = 0;
+  static long bufsz = 0;
+
+  if( sb->view ) return sb->view( pos, sizep );
+  const long len = min( *sizep, (long)part_size );
+  if( !resize_buffer( &buf, &bufsz, len ) || !sb->read( buf, pos, len ) )
+    return 0;
+  *sizep = len;
+  return buf;
+  }
+
+
+/* Return true if the backend in use keeps all the text in memory, so that
+   it can be read with view_scratch_shared. */
+bool scratch_shared( void )
+  { return sb == &memory_backend || sb == &mmap_backend; }
+
+
+/* Like get_scratch_part, but may be called from several threads at once
+   if scratch_shared(), as long as no text is written meanwhile. */
+const char * view_scratch_shared( const long pos, long * const sizep )
+  {
+  if( sb == &mmap_backend ) return smap + pos;
+  const int o = pos % mchunk_size;
+  *sizep = min( *sizep, (long)( mchunk_size - o ) );
+  return mchunks[pos/mchunk_size] + o;
+  }
+
+
+enum { block_size = 1 << 16 };
+static char block_buf[block_size];	/* for move_scratch and copy_scratch */
+
+/* Move len bytes of the scratch buffer from position src to position dst,
+   which is not greater than src. Return false if error. */
+bool move_scratch( long dst, long src, long len )
+  {
+  if( dst == src ) return true;
+  while( len > 0 )
+    {
+    const int n = min( len, (long)block_size );
+    if( !sb->read( block_buf, src, n ) || !sb->write( block_buf, dst, n ) )
+      return false;
+    dst += n; src += n; len -= n;
+    }
+  return true;
+  }
+
+
+/* Append a copy of len bytes of the scratch buffer at position src.
+   Return the position of the copy, or -1 if error. */
+long copy_scratch( long src, long len )
+  {
+  const long pos = ssize;
+
+  while( len > 0 )
+    {
+    const int n = min( len, (long)block_size );
+    if( !sb->read( block_buf, src, n ) || append_scratch( block_buf, n ) < 0 )
+      return -1;
+    src += n; len -= n;
+    }
+  return pos;
+  }
+
+
+/* Discard the contents of the scratch buffer beyond size bytes. */
+bool truncate_scratch( const long size )
+  {
+  if( !sb->truncate( size ) ) return false;
+  ssize = size;
+  return true;
+  }
+
+
+void print_scratch_stats( void )
+  {
+  if( !sb ) return;
+  fprintf( stderr, "scratch storage: %s", sb->name );
+  if( sb != selected ) fprintf( stderr, " (selected %s)", selected->name );
+  fputc( '\n', stderr );
+  if( sb->stats ) sb->stats();
+  }
@@ -19,6 +19,7 @@
 
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -43,7 +44,7 @@ const char * home_directory( void )
   {
   static bool first_time = true;
   static char * buf = 0;
-  static int bufsz = 0;
+  static long bufsz = 0;
 
   if( first_time )
     {
@@ -177,15 +178,14 @@ int window_lines( void )
   }
 
 
-/* assure at least a minimum size for buffer 'buf' up to INT_MAX - 1 */
-bool resize_buffer( char ** const buf, int * const size, const unsigned min_size )
+/* assure at least a minimum size for buffer 'buf' up to LONG_MAX / 2 */
+bool resize_buffer( char ** const buf, long * const size, const long min_size )
   {
-  if( (unsigned)*size < min_size )
+  if( *size < min_size || min_size < 0 )
     {
-    if( min_size >= INT_MAX )
+    if( min_size < 0 || min_size >= LONG_MAX / 4 )
       { set_error_msg( "Line too long" ); return false; }
-    const int new_size = ( ( min_size < 512 ) ? 512 :
-      ( min_size >= INT_MAX / 2 ) ? INT_MAX - 1 : ( min_size / 512 ) * 1024 );
+    const long new_size = ( min_size < 512 ) ? 512 : ( min_size / 512 ) * 1024;
     void * new_buf = 0;
     disable_interrupts();
     if( *buf ) new_buf = realloc( *buf, new_size );
@@ -199,3 +199,30 @@ bool resize_buffer( char ** const buf, int * const size, const unsigned min_size
     }
   return true;
   }
+
+
+/* Call worker once for each of the n elements of size arg_size of array
+   args, each in its own thread, and wait for all of them to finish.
+   Signals are blocked in the worker threads so that they are always
+   handled by the main thread. If a thread can't be created, its element
+   is processed by the calling thread.
+*/
+void run_jobs( void * (*worker)( void * ), void * const args,
+               const int arg_size, const int n )
+  {
+  pthread_t threads[max_jobs];
+  bool created[max_jobs];
+  sigset_t set, old_set;
+  int i;
+
+  sigfillset( &set );
+  pthread_sigmask( SIG_BLOCK, &set, &old_set );
+  const int nt = min( n, max_jobs );
+  for( i = 0; i < nt; ++i )
+    created[i] = pthread_create( &threads[i], 0, worker,
+                                 (char *)args + i * arg_size ) == 0;
+  pthread_sigmask( SIG_SETMASK, &old_set, 0 );
+  for( i = 0; i < n; ++i )
+    if( i >= nt || !created[i] ) worker( (char *)args + i * arg_size );
+  for( i = 0; i < nt; ++i ) if( created[i] ) pthread_join( threads[i], 0 );
+  }
@@ -50,6 +50,106 @@ echo "p" | "${ED}" -s +/[A-Z] test.txt | grep -q 'two' || test_failed $LINENO
 echo "p" | "${ED}" -s +?[A-Z] test.txt | grep -q 'even' || test_failed $LINENO
 # test that a second 'e' succeeds
 printf "a\nHello world!\n.\ne test.txt\nf foo.txt\nf\nh\nH\nH\nkx\nl\nn\np\nP\nP\ny\n.z\n# comment\n=\n!:\n.\ne test.txt\n8p\n" | "${ED}" -s | grep -q 'agrarian' || test_failed $LINENO
+# scratch buffer kept in memory, moved to a file, or always in a file
+echo ",p" | "${ED}" -s test.txt | cmp -s - test.txt || test_failed $LINENO
+echo ",p" | "${ED}" -s --scratch-mem=100 test.txt | cmp -s - test.txt ||
+	test_failed $LINENO
+echo ",p" | "${ED}" -s --scratch-mem=0 test.txt | cmp -s - test.txt ||
+	test_failed $LINENO
+"${ED}" -q --scratch-mem=1x test.txt < empty
+[ $? = 1 ] || test_failed $LINENO
+for i in memory mmap file compressed ; do
+	printf "1,3t\$\n2,4d\ng/e/s/e/E/\n,p\nQ\n" |
+		"${ED}" -s --scratch=$i --scratch-mem=0 test.txt > out_$i ||
+		test_failed $LINENO $i
+done
+cmp -s out_memory out_mmap || test_failed $LINENO
+cmp -s out_memory out_file || test_failed $LINENO
+cmp -s out_memory out_compressed || test_failed $LINENO
+echo ",p" | "${ED}" -s --scratch=file --stats test.txt 2> stats |
+	cmp -s - test.txt || test_failed $LINENO
+grep -q 'scratch storage: file' stats || test_failed $LINENO
+"${ED}" -q --scratch=disk test.txt < empty
+[ $? = 1 ] || test_failed $LINENO
+# files loaded by several threads
+cat test.txt test.txt test.txt test.txt > big.txt || framework_failure
+for i in 1 2 3 4 5 6 7 8 9 10 ; do
+	cat big.txt big.txt > big2.txt && mv -f big2.txt big.txt ||
+		framework_failure
+done
+echo ",p" | "${ED}" -s --jobs=4 big.txt | cmp -s - big.txt ||
+	test_failed $LINENO
+echo ",p" | "${ED}" -s --jobs=4 --strip-trailing-cr big.txt |
+	cmp -s - big.txt || test_failed $LINENO
+printf "r big.txt\nw out.txt\n" | "${ED}" -s --jobs=3 test.txt ||
+	test_failed $LINENO
+cat test.txt big.txt | cmp -s - out.txt || test_failed $LINENO
+# lines of a global command matched, and substitutions in a large range
+# computed, by several threads
+for i in 1 4 ; do
+	printf "r big.txt\nr big.txt\nr big.txt\ng/of.*t[h]e/s/^/x/\nv/the/d\nw out$i.txt\n" |
+		"${ED}" -s --jobs=$i || test_failed $LINENO
+	printf "r big.txt\nr big.txt\nr big.txt\n,s/e/E\\\\\\n/2\n.=\nw sub$i.txt\nu\n.=\nQ\n" |
+		"${ED}" -s --jobs=$i > num$i.txt || test_failed $LINENO
+done
+cmp -s out1.txt out4.txt || test_failed $LINENO
+cmp -s sub1.txt sub4.txt || test_failed $LINENO
+cmp -s num1.txt num4.txt || test_failed $LINENO
+rm -f out1.txt out4.txt sub1.txt sub4.txt num1.txt num4.txt
+"${ED}" -q --jobs=0 test.txt < empty
+[ $? = 1 ] || test_failed $LINENO
+# compressed scratch buffer; big.txt does not fit in the chunks in memory
+printf ",s/^/x/\n,s/^x//\nw out.txt\n" |
+	"${ED}" -s --scratch=compressed --scratch-mem=0 --stats big.txt 2> stats ||
+	test_failed $LINENO
+cmp -s out.txt big.txt || test_failed $LINENO
+grep -q 'compressed chunks: 4 in memory' stats || test_failed $LINENO
+# identical lines share their text; big.txt is test.txt repeated
+printf ",s/^/x/\n,s/^x//\nw out.txt\n" |
+	"${ED}" -s --dedup-lines --stats big.txt 2> stats || test_failed $LINENO
+cmp -s out.txt big.txt || test_failed $LINENO
+grep -q 'distinct lines indexed' stats || test_failed $LINENO
+grep -q 'scratch buffer: [0-9]\{1,4\} bytes' stats || test_failed $LINENO
+# line index in a temporary file, also filled by several threads
+printf ",s/^/x/\n,s/^x//\nw out.txt\n" |
+	"${ED}" -s --index-file --jobs=4 --stats big.txt 2> stats ||
+	test_failed $LINENO
+cmp -s out.txt big.txt || test_failed $LINENO
+grep -q 'index file: [0-9]* bytes in [0-9]* extents' stats || test_failed $LINENO
+# literal patterns match the same lines as the equivalent bracket expressions
+printf "g/the/n\ng/^All/In\ng/ety\\.\$/n\ng/a.d/n\n" |
+	"${ED}" -s test.txt > out.txt || test_failed $LINENO
+printf "g/[t]he/n\ng/^[Aa][Ll][Ll]/n\ng/et[y][.]\$/n\ng/a.[d]/n\n" |
+	"${ED}" -s test.txt > out2.txt || test_failed $LINENO
+cmp -s out.txt out2.txt || test_failed $LINENO
+# lines without the string required by a regex are rejected before regexec
+printf "g/of.*t[h]e/n\n" | "${ED}" -s --stats test.txt > out.txt 2> stats ||
+	test_failed $LINENO
+grep -q 'regex prefilter: [0-9]* lines searched, [1-9]' stats ||
+	test_failed $LINENO
+printf "g/of.*the|zzzz/n\n" | "${ED}" -s -E test.txt > out2.txt ||
+	test_failed $LINENO
+cmp -s out.txt out2.txt || test_failed $LINENO
+# regexes used again are taken from the cache of compiled regexes
+printf "/of/\n/the/\n/of/\ng/the/d\nQ\n" | "${ED}" -s --stats test.txt 2>&1 |
+	grep -q 'regex cache: 2 hits, 2 misses' || test_failed $LINENO
+# lines referenced in the mapped file, which is copied before overwriting it
+cat test.txt > mapped.txt || framework_failure
+echo ",p" | "${ED}" -s --map-files mapped.txt | cmp -s - test.txt ||
+	test_failed $LINENO
+printf "1d\nw\nu\nw\n" | "${ED}" -s --map-files mapped.txt ||
+	test_failed $LINENO
+cmp -s mapped.txt test.txt || test_failed $LINENO
+# node pool statistics; the yank buffer shares the 3 nodes deleted by 2,4d
+printf "2,4d\n1,2t0\nQ\n" | "${ED}" -s --stats test.txt 2>&1 > /dev/null |
+	grep -q 'line nodes: 15 in use (peak 15), 15 allocated, 0 freed' ||
+	test_failed $LINENO
+# 'u' copies them to the yank buffer before restoring them
+printf "2,4d\nu\n0a\nnew\n.\n\$x\nw out.txt\n" | "${ED}" -s test.txt ||
+	test_failed $LINENO
+{ echo new ; cat test.txt ; sed -n 2,4p test.txt ; } > out2.txt ||
+	framework_failure
+cmp -s out.txt out2.txt || test_failed $LINENO
 echo "q" | "${ED}" -q 'name_with_bell.txt' && test_failed $LINENO
 echo "q" | "${ED}" -q --unsafe-names 'name_with_bell.txt' || test_failed $LINENO
 
@@ -116,7 +216,7 @@ for i in "${testdir}"/*.ed ; do
 	rm -f out.o out.log
 done
 
-rm -f test.txt test.bin empty
+rm -f test.txt test.bin empty big.txt out.txt mapped.txt
 
 if [ ${fail} = 0 ] ; then
 	echo "tests completed successfully."
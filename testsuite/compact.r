@@ -0,0 +1,13 @@
+This natural inequality of the two powers of population and of
+production in thE Earth, and that grEat law of our naturE which must
+constantly kEEp thEir EffEcts Equal, form thE grEat difficulty that tome appears insurmountable in the way to the perfectibility of society.
+appended line
+All other arguments are of slight and subordinate consideration in
+agrarian regulations in their utmost extent, could remove the pressure
+of it even for a single century. And it appears, therefore, to be
+decisive against the possible existence of a society, all the members of
+which should live in ease, happiness, and comparative leisure; and feel
+no anxiety about providing the means of subsistence for themselves and
+their families.
+This natural inequality of the two powers of population and of
+production in thE Earth, and that grEat law of our naturE which must